@@ -8,6 +8,13 @@
 #include <vector>
 #include <memory>
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cmath>
+#include <iostream>
+#include <thread>
+#include <future>
+#include <array>
 #include <mesh.h>
 
 struct BVH_Item
@@ -20,45 +27,107 @@ struct BVH_Item
     glm::vec3 center;
 };
 
-struct BVH_Node
+// Depth-first linearized node (PBRT's LinearBVHNode). The first child of an interior
+// node is always the next node in the array, so only the second child is stored.
+// The layout matches the std430 BVH_Node struct in raytracing.comp.
+struct BVH_LinearNode
 {
-    int id;
-    std::shared_ptr<BVH_Node> children[2];
-    int objectOffset, objectCount, splitAxis;
-    BoundingBox bbox;
+    glm::vec3 Pmin;
+    int offset; // leaf: first ordered object, interior: second child index
+    glm::vec3 Pmax;
+    uint16_t objectCount; // 0 for interior nodes
+    uint8_t splitAxis;
+    uint8_t pad[1];
+};
+static_assert(sizeof(BVH_LinearNode) == 32, "BVH_LinearNode must match the GPU layout");
+
+enum BVH_Build_Mode
+{
+    SAH,          // single-threaded binned SAH, reference builder
+    PARALLEL_SAH, // same SAH cost model, subtrees and upper-level binning spread across cores
+    LBVH,         // Morton code sort and bit split, fastest to build, lowest quality
+    HLBVH,        // LBVH treelets joined by SAH upper levels
+    SBVH,         // SAH with spatial splits duplicating the items across the split plane, slowest to
+                  // build, best for long thin triangles whose bounds overlap
 };
 
 class BVH_Accelerator
 {
 public:
+    BVH_Build_Mode buildMode = PARALLEL_SAH;
+    bool logBuilds = true;
+    // refitTree rebuilds instead once the SAH cost grew this much over the last build
+    float refitMaxCostGrowth = 1.3f;
+    // SBVH: spatial splits are only tried where the children of the best object split overlap by
+    // more than this fraction of the root surface area
+    float spatialSplitOverlap = 1e-3f;
+    // SBVH: items duplicated by spatial splits, as a fraction of the objects
+    float spatialSplitBudget = 1.0f;
+
     // constructor
     BVH_Accelerator()
     {
         // std::cout << "Hola BVH" << std::endl;
     }
 
-    void buildTree(std::vector<std::shared_ptr<BoundingBox>> objects, int maxNodeItems)
+    // SBVH clips the objects to the split planes as triangles when triangles holds three vertices
+    // per object, and as boxes otherwise
+    void buildTree(const std::vector<BoundingBox> &objects, int maxNodeItems, const std::vector<glm::vec3> *triangles = nullptr)
     {
-        if (root != nullptr)
-        {
-            this->items.clear();
-            this->orderedObjects.clear();
-            this->totalNodes = 0;
-            tree.clear();
-        }
+        auto start = std::chrono::high_resolution_clock::now();
+        this->items.clear();
+        this->orderedObjects.clear();
+        this->nodes.clear();
 
+        items.reserve(objects.size());
         for (size_t i = 0; i < objects.size(); i++)
         {
-            items.push_back(BVH_Item(i, *objects[i]));
+            items.push_back(BVH_Item(i, objects[i]));
         }
         this->maxNodeItems = maxNodeItems;
+        if (items.empty())
+            return;
 
         // std::cout << "Building BVH" << std::endl;
-        root = recursiveBuild(0, objects.size(), objects);
+        switch (buildMode)
+        {
+        case SAH:
+            // a binary tree with at least one item per leaf never has more than 2n - 1 nodes
+            nodes.reserve(2 * items.size() - 1);
+            recursiveBuild(0, items.size());
+            break;
+        case SBVH:
+            spatialSplitBuild(triangles);
+            break;
+        default:
+            parallelBuild();
+            break;
+        }
+
+        // leaves cover the partitioned items in depth-first order, so the item order is the object order
+        orderedObjects.resize(items.size());
+        for (size_t i = 0; i < items.size(); i++)
+            orderedObjects[i] = items[i].index;
+        builtSAHCost = getSAHCost();
+
+        auto end = std::chrono::high_resolution_clock::now();
+        if (logBuilds)
+        {
+            std::cout << "BVH built (" << buildModeName() << "): " << objects.size() << " items, ";
+            if (items.size() != objects.size())
+                std::cout << items.size() << " references, ";
+            std::cout << nodes.size() << " nodes ("
+                      << nodes.size() * sizeof(BVH_LinearNode) / 1024 << " KB) in "
+                      << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+        }
     }
 
-    std::shared_ptr<BVH_Node> recursiveBuild(int start, int end, std::vector<std::shared_ptr<BoundingBox>> objects)
+    // builds the subtree of items [start, end) in depth-first order and returns its node index
+    int recursiveBuild(int start, int end)
     {
+        int nodeIndex = nodes.size();
+        nodes.emplace_back();
+
         // Compute bounds of all primitives in BVH node
         BoundingBox bbox = items[start].boundingBox;
         for (int i = start + 1; i < end; ++i)
@@ -74,13 +143,7 @@ public:
         if (nItems == 1)
         {
             // Create leaf node
-            int firstItemOffset = orderedObjects.size();
-            for (int i = start; i < end; ++i)
-            {
-                int itemIndex = items[i].index;
-                orderedObjects.push_back(itemIndex);
-            }
-            return createLeaf(firstItemOffset, nItems, bbox);
+            return createLeaf(nodeIndex, start, end, bbox);
         }
 
         // Compute bound of primitive centroids, choose split dimension dim
@@ -90,22 +153,16 @@ public:
         // std::cout << "Centers bbox (" << centerBbox.Pmin.x << ", " << centerBbox.Pmin.y << ", " << centerBbox.Pmin.z << ")";
         // std::cout << ", (" << centerBbox.Pmax.x << ", " << centerBbox.Pmax.y << ", " << centerBbox.Pmax.z << ")" << std::endl;
         int dim = centerBbox.maximumExtent();
-        if (centerBbox.Pmax[dim] == centerBbox.Pmin[dim])
+        if (centerBbox.Pmax[dim] == centerBbox.Pmin[dim] && nItems <= maxLeafItems)
         {
             // Create leaf node
             // std::cout << "No dimension." << std::endl;
-            int firstItemOffset = orderedObjects.size();
-            for (int i = start; i < end; ++i)
-            {
-                int itemIndex = items[i].index;
-                orderedObjects.push_back(itemIndex);
-            }
-            return createLeaf(firstItemOffset, nItems, bbox);
+            return createLeaf(nodeIndex, start, end, bbox);
         }
 
         // Partition primitives into two sets using approximate SAH and build children
         int mid = (start + end) / 2;
-        if (nItems <= 4)
+        if (nItems <= 4 || centerBbox.Pmax[dim] == centerBbox.Pmin[dim])
         {
             // Partition primitives into equally sized subsets
             mid = (start + end) / 2;
@@ -123,161 +180,1059 @@ public:
             // std::cout << std::endl;
 
             // std::cout << "Creating intermediate node..." << std::endl;
-            int nodeId = totalNodes++;
-            return createNode(nodeId,
-                              recursiveBuild(start, mid, objects),
-                              recursiveBuild(mid, end, objects));
+            recursiveBuild(start, mid);
+            int secondChild = recursiveBuild(mid, end);
+            return createNode(nodeIndex, secondChild, dim, bbox);
         }
 
-        // Allocate BucketInfo for SAH partition buckets
-        constexpr int nBuckets = 12;
+        // Initialize BucketInfo for SAH partition buckets
+        BucketInfo buckets[nBuckets];
+        for (int i = start; i < end; ++i)
+            addToBucket(buckets[getBucket(centerBbox, dim, items[i].center)], items[i]);
 
-        struct BucketInfo
+        // Find bucket to split at that minimizes SAH metric
+        int minCostSplitBucket;
+        float minCost = findSAHSplit(buckets, bbox, minCostSplitBucket);
+
+        // Either create leaf or split primitives at selected SAH bucket
+        float leafCost = nItems;
+        if (nItems > maxNodeItems || nItems > maxLeafItems || minCost < leafCost)
         {
-            int count = 0;
-            BoundingBox boundingBox;
-        };
-        BucketInfo buckets[nBuckets];
+            BVH_Item *pmid = std::partition(&items[start],
+                                            &items[end - 1] + 1,
+                                            [=](const BVH_Item &pi)
+                                            {
+                                                return getBucket(centerBbox, dim, pi.center) <= minCostSplitBucket;
+                                            });
+            mid = pmid - &items[0];
+            // if (nItems > maxNodeItems)
+                // std::cout << "Too much items. Spliting at " << mid << std::endl;
+            // if (minCost < leafCost)
+                // std::cout << "Bucket intersection costs less. Spliting at " << mid << std::endl;
 
-        // Initialize BucketInfo for SAH partition buckets
-        for (int i = start; i < end; ++i)
+            // std::cout << "Creating intermediate node..." << std::endl;
+            recursiveBuild(start, mid);
+            int secondChild = recursiveBuild(mid, end);
+            return createNode(nodeIndex, secondChild, dim, bbox);
+        }
+        else
+        {
+            // Create leaf node
+            // std::cout << "Expensive bucket intersection." << std::endl;
+            return createLeaf(nodeIndex, start, end, bbox);
+        }
+    }
+
+    // Recomputes the node bounds bottom-up from the updated item bounds, keeping the tree
+    // topology. Falls back to buildTree when the number of items changed (or items were
+    // duplicated by spatial splits) or the refitted tree
+    // costs more than refitMaxCostGrowth times the last build. Returns true if it refitted.
+    bool refitTree(const std::vector<BoundingBox> &objects)
+    {
+        if (objects.size() != orderedObjects.size() || nodes.empty())
         {
-            int b = nBuckets *
-                    centerBbox.offset(items[i].center)[dim]; // 0 to 1
-            if (b == nBuckets)
-                b = nBuckets - 1;
-            buckets[b].count++;
-            if (buckets[b].count == 1)
-                buckets[b].boundingBox = items[i].boundingBox;
+            buildTree(objects, maxNodeItems);
+            return false;
+        }
+
+        // children always come after their parent in depth-first order
+        for (int i = nodes.size() - 1; i >= 0; i--)
+        {
+            BVH_LinearNode &node = nodes[i];
+            BoundingBox bbox;
+            if (node.objectCount > 0)
+            {
+                bbox = objects[orderedObjects[node.offset]];
+                for (int k = node.offset + 1; k < node.offset + node.objectCount; k++)
+                    bbox = getTotalBoundingBox(bbox, objects[orderedObjects[k]]);
+            }
             else
-                buckets[b].boundingBox = getTotalBoundingBox(buckets[b].boundingBox, items[i].boundingBox);
+                bbox = getTotalBoundingBox(BoundingBox{nodes[i + 1].Pmin, nodes[i + 1].Pmax},
+                                           BoundingBox{nodes[node.offset].Pmin, nodes[node.offset].Pmax});
+            node.Pmin = bbox.Pmin;
+            node.Pmax = bbox.Pmax;
+        }
+
+        float cost = getSAHCost();
+        if (cost > builtSAHCost * refitMaxCostGrowth)
+        {
+            if (logBuilds)
+                std::cout << "BVH refit cost " << cost << " over " << refitMaxCostGrowth << "x the built cost "
+                          << builtSAHCost << ", rebuilding" << std::endl;
+            buildTree(objects, maxNodeItems);
+            return false;
+        }
+        return true;
+    }
+
+    // expected cost of a ray through the tree relative to intersecting one item, same model as the builders
+    float getSAHCost()
+    {
+        if (nodes.empty())
+            return 0.0f;
+        float cost = 0.0f;
+        for (auto &&node : nodes)
+        {
+            float area = BoundingBox{node.Pmin, node.Pmax}.surfaceArea();
+            cost += node.objectCount > 0 ? node.objectCount * area : traversalCost * area;
+        }
+        float rootArea = BoundingBox{nodes[0].Pmin, nodes[0].Pmax}.surfaceArea();
+        return rootArea > 0.0f ? cost / rootArea : nodes.size();
+    }
+
+    const std::vector<BVH_LinearNode> &getBVHTree()
+    {
+        return nodes;
+    }
+
+    // object of every item in leaf order, objects split by an SBVH appear more than once
+    const std::vector<int> &getOrderedObjects()
+    {
+        return orderedObjects;
+    }
+
+private:
+    // leaves store their item count in 16 bits
+    static constexpr int maxLeafItems = 0xFFFF;
+
+    // SAH partition buckets
+    static constexpr int nBuckets = 12;
+    // cost of visiting a node relative to intersecting an item
+    static constexpr float traversalCost = 0.125f;
+
+    struct BucketInfo
+    {
+        int count = 0;
+        BoundingBox boundingBox;
+    };
+
+    // parallel build: ranges smaller than this are binned and partitioned by a single thread
+    static constexpr int parallelItemsThreshold = 1 << 14;
+    // and subtrees smaller than this are built without forking
+    static constexpr int forkItemsThreshold = 1 << 12;
+
+    std::vector<BVH_Item> items;
+    std::vector<int> orderedObjects;
+    int maxNodeItems = 1;
+    float builtSAHCost = 0.0f;
+
+    std::vector<BVH_LinearNode> nodes;
+
+    // Morton codes use 10 bits per axis, the top 12 bits define the HLBVH treelets
+    static constexpr int mortonBits = 30;
+    static constexpr int treeletBits = 12;
+    static constexpr int radixBitsPerPass = 6;
+
+    // SBVH spatial split bins per axis
+    static constexpr int nSpatialBins = 32;
+
+    struct SpatialBin
+    {
+        int enter = 0; // items starting in the bin
+        int exit = 0;  // items ending in the bin
+        bool valid = false;
+        BoundingBox boundingBox; // clipped parts of the items in the bin
+    };
+
+    // SBVH build state
+    const std::vector<glm::vec3> *splitTriangles = nullptr;
+    float rootSurfaceArea = 0.0f;
+
+    // parallel build state
+    std::vector<BVH_Item> scratchItems;
+    std::vector<uint32_t> mortonCodes;
+    std::vector<uint8_t> usedNodes;
+    unsigned int numThreads = 1;
+
+    const char *buildModeName()
+    {
+        switch (buildMode)
+        {
+        case PARALLEL_SAH:
+            return "parallel SAH";
+        case LBVH:
+            return "LBVH";
+        case HLBVH:
+            return "HLBVH";
+        case SBVH:
+            return "SBVH";
+        default:
+            return "SAH";
         }
+    }
 
-        // Compute costs for splitting after each bucket
+    static int getBucket(const BoundingBox &centerBbox, int dim, const glm::vec3 &center)
+    {
+        int b = nBuckets * centerBbox.offset(center)[dim]; // 0 to 1
+        if (b == nBuckets)
+            b = nBuckets - 1;
+        return b;
+    }
+
+    static void addToBucket(BucketInfo &bucket, const BVH_Item &item)
+    {
+        bucket.count++;
+        if (bucket.count == 1)
+            bucket.boundingBox = item.boundingBox;
+        else
+            bucket.boundingBox = getTotalBoundingBox(bucket.boundingBox, item.boundingBox);
+    }
+
+    static void mergeBucket(BucketInfo &bucket, const BucketInfo &other)
+    {
+        if (other.count == 0)
+            return;
+        if (bucket.count == 0)
+            bucket.boundingBox = other.boundingBox;
+        else
+            bucket.boundingBox = getTotalBoundingBox(bucket.boundingBox, other.boundingBox);
+        bucket.count += other.count;
+    }
+
+    // Computes the SAH cost of splitting after each bucket and returns the cheapest one.
+    // Empty buckets do not contribute to the bounds of either side.
+    static float findSAHSplit(const BucketInfo buckets[nBuckets], const BoundingBox &bbox, int &minCostSplitBucket)
+    {
         float cost[nBuckets - 1];
         for (int i = 0; i < nBuckets - 1; ++i)
         {
-            BoundingBox b0 = buckets[0].boundingBox;
-            int count0 = 0, count1 = 0;
-            for (int j = 1; j <= i; ++j)
-            {
-                b0 = getTotalBoundingBox(b0, buckets[j].boundingBox);
-                count0 += buckets[j].count;
-            }
-            BoundingBox b1 = buckets[i + 1].boundingBox;
-            for (int j = i + 2; j < nBuckets; ++j)
-            {
-                b1 = getTotalBoundingBox(b1, buckets[j].boundingBox);
-                count1 += buckets[j].count;
-            }
-            cost[i] = .125f + (count0 * b0.surfaceArea() +
-                               count1 * b1.surfaceArea()) /
+            BucketInfo b0, b1;
+            for (int j = 0; j <= i; ++j)
+                mergeBucket(b0, buckets[j]);
+            for (int j = i + 1; j < nBuckets; ++j)
+                mergeBucket(b1, buckets[j]);
+            float area0 = b0.count > 0 ? b0.boundingBox.surfaceArea() : 0.0f;
+            float area1 = b1.count > 0 ? b1.boundingBox.surfaceArea() : 0.0f;
+            cost[i] = traversalCost + (b0.count * area0 +
+                               b1.count * area1) /
                                   bbox.surfaceArea();
-            // std::cout << "Cost: " << count0 * b0.surfaceArea() << ", " << count1 * b1.surfaceArea() << ", " << bbox.surfaceArea() << ", "
+            // std::cout << "Cost: " << b0.count * area0 << ", " << b1.count * area1 << ", " << bbox.surfaceArea() << ", "
                     //   << cost[i] << std::endl;
         }
 
-        // Find bucket to split at that minimizes SAH metric
         float minCost = cost[0];
-        int minCostSplitBucket = 0;
-        // std::cout << "Costs: ";
+        minCostSplitBucket = 0;
         for (int i = 1; i < nBuckets - 1; ++i)
         {
-            // std::cout << cost[i] << ", ";
             if (cost[i] < minCost)
             {
                 minCost = cost[i];
                 minCostSplitBucket = i;
             }
         }
-        // std::cout << std::endl;
+        return minCost;
+    }
 
-        // Either create leaf or split primitives at selected SAH bucket
+    // SBVH (Stich et al. 2009): every node takes the cheapest of the binned object split and a
+    // spatial split, which clips the items to the split plane and lets the straddling ones go
+    // to both children. Leaves take their items from the references of their node.
+    void spatialSplitBuild(const std::vector<glm::vec3> *triangles)
+    {
+        std::vector<BVH_Item> references;
+        references.swap(items);
+        items.reserve(references.size());
+        splitTriangles = triangles;
+        int budget = spatialSplitBudget * references.size();
+
+        BoundingBox bbox = references[0].boundingBox;
+        for (auto &&reference : references)
+            bbox = getTotalBoundingBox(bbox, reference.boundingBox);
+        rootSurfaceArea = bbox.surfaceArea();
+
+        nodes.reserve(2 * references.size() - 1);
+        recursiveSpatialSplitBuild(references, budget);
+        splitTriangles = nullptr;
+    }
+
+    // Builds the subtree of the references in depth-first order and returns its node index, the
+    // references are released before building the children. The subtree may duplicate up to
+    // budget references, what a split leaves is shared by the children in proportion to their size,
+    // so the upper levels cannot take the whole budget.
+    int recursiveSpatialSplitBuild(std::vector<BVH_Item> &references, int budget)
+    {
+        int nodeIndex = nodes.size();
+        nodes.emplace_back();
+        int nItems = references.size();
+
+        BoundingBox bbox = references[0].boundingBox;
+        BoundingBox centerBbox{references[0].center, references[0].center};
+        for (int i = 1; i < nItems; ++i)
+        {
+            bbox = getTotalBoundingBox(bbox, references[i].boundingBox);
+            centerBbox = getTotalBoundingBox(centerBbox, references[i].center);
+        }
+        if (nItems == 1)
+            return createSpatialLeaf(nodeIndex, references, bbox);
+
+        // Object split, the same binned SAH as recursiveBuild
+        int dim = centerBbox.maximumExtent();
+        bool objectSplit = centerBbox.Pmax[dim] > centerBbox.Pmin[dim];
+        float objectCost = INFINITY;
+        int minCostSplitBucket = 0;
+        float overlapArea = INFINITY;
+        if (objectSplit)
+        {
+            BucketInfo buckets[nBuckets];
+            for (auto &&reference : references)
+                addToBucket(buckets[getBucket(centerBbox, dim, reference.center)], reference);
+            objectCost = findSAHSplit(buckets, bbox, minCostSplitBucket);
+
+            BucketInfo b0, b1;
+            for (int b = 0; b < nBuckets; ++b)
+                mergeBucket(b <= minCostSplitBucket ? b0 : b1, buckets[b]);
+            overlapArea = 0.0f;
+            if (b0.count > 0 && b1.count > 0)
+            {
+                glm::vec3 overlap = glm::min(b0.boundingBox.Pmax, b1.boundingBox.Pmax) - glm::max(b0.boundingBox.Pmin, b1.boundingBox.Pmin);
+                if (overlap.x > 0.0f && overlap.y > 0.0f && overlap.z > 0.0f)
+                    overlapArea = BoundingBox{glm::vec3(0.0f), overlap}.surfaceArea();
+            }
+        }
+
+        // Spatial split, only where the object split children overlap and the budget allows it
+        float spatialCost = INFINITY;
+        int spatialDim = 0;
+        float spatialPosition = 0.0f;
+        if (budget > 0 && overlapArea > spatialSplitOverlap * rootSurfaceArea)
+            spatialCost = findSpatialSplit(references, bbox, budget, spatialDim, spatialPosition);
+
+        // Either create leaf or split at the cheapest split
         float leafCost = nItems;
-        if (nItems > maxNodeItems || minCost < leafCost)
+        float minCost = std::min(objectCost, spatialCost);
+        bool mustSplit = nItems > maxNodeItems || nItems > maxLeafItems;
+        if ((!mustSplit && minCost >= leafCost) || (!objectSplit && spatialCost == INFINITY && nItems <= maxLeafItems))
+            return createSpatialLeaf(nodeIndex, references, bbox);
+
+        std::vector<BVH_Item> left, right;
+        int axis = dim;
+        if (spatialCost < objectCost)
         {
-            BVH_Item *pmid = std::partition(&items[start],
-                                            &items[end - 1] + 1,
-                                            [=](const BVH_Item pi)
-                                            {
-                                                int b = nBuckets * centerBbox.offset(pi.center)[dim];
-                                                if (b == nBuckets)
-                                                    b = nBuckets - 1;
-                                                return b <= minCostSplitBucket;
-                                            });
-            mid = pmid - &items[0];
-            // if (nItems > maxNodeItems)
-                // std::cout << "Too much items. Spliting at " << mid << std::endl;
-            // if (minCost < leafCost)
-                // std::cout << "Bucket intersection costs less. Spliting at " << mid << std::endl;
+            splitReferences(references, spatialDim, spatialPosition, left, right);
+            axis = spatialDim;
+        }
+        if (left.empty() || right.empty())
+        {
+            left.clear();
+            right.clear();
+            axis = dim;
+            for (auto &&reference : references)
+                (objectSplit && getBucket(centerBbox, dim, reference.center) <= minCostSplitBucket ? left : right).push_back(reference);
+            if (left.empty() || right.empty())
+            {
+                // Partition primitives into equally sized subsets
+                std::nth_element(references.begin(), references.begin() + nItems / 2, references.end(),
+                                 [dim](const BVH_Item &a, const BVH_Item &b)
+                                 {
+                                     return a.center[dim] < b.center[dim];
+                                 });
+                left.assign(references.begin(), references.begin() + nItems / 2);
+                right.assign(references.begin() + nItems / 2, references.end());
+            }
+        }
+        budget -= int(left.size() + right.size()) - nItems;
+        int leftBudget = int64_t(budget) * left.size() / (left.size() + right.size());
+        std::vector<BVH_Item>().swap(references);
 
-            // std::cout << "Creating intermediate node..." << std::endl;
-            int nodeId = totalNodes++;
-            return createNode(nodeId,
-                              recursiveBuild(start, mid, objects),
-                              recursiveBuild(mid, end, objects));
+        recursiveSpatialSplitBuild(left, leftBudget);
+        int secondChild = recursiveSpatialSplitBuild(right, budget - leftBudget);
+        return createNode(nodeIndex, secondChild, axis, bbox);
+    }
+
+    int createSpatialLeaf(int nodeIndex, const std::vector<BVH_Item> &references, BoundingBox bbox)
+    {
+        int start = items.size();
+        items.insert(items.end(), references.begin(), references.end());
+        return createLeaf(nodeIndex, start, items.size(), bbox);
+    }
+
+    // Bins the references clipped to nSpatialBins slabs per axis and returns the SAH cost of the
+    // cheapest split plane that duplicates at most budget references
+    float findSpatialSplit(const std::vector<BVH_Item> &references, const BoundingBox &bbox, int budget, int &minCostDim, float &minCostPosition)
+    {
+        int nItems = references.size();
+        float minCost = INFINITY;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float binSize = (bbox.Pmax[axis] - bbox.Pmin[axis]) / nSpatialBins;
+            if (binSize <= 0.0f)
+                continue;
+            auto getBin = [&](float p)
+            {
+                return std::min(std::max(int((p - bbox.Pmin[axis]) / binSize), 0), nSpatialBins - 1);
+            };
+
+            SpatialBin bins[nSpatialBins];
+            for (auto &&reference : references)
+            {
+                int first = getBin(reference.boundingBox.Pmin[axis]);
+                int last = getBin(reference.boundingBox.Pmax[axis]);
+                BoundingBox rest = reference.boundingBox;
+                bool restValid = true;
+                for (int b = first; b < last && restValid; b++)
+                {
+                    BoundingBox leftPart, rightPart;
+                    bool leftValid, rightValid;
+                    splitReference(reference, rest, axis, bbox.Pmin[axis] + (b + 1) * binSize, leftPart, leftValid, rightPart, rightValid);
+                    if (leftValid)
+                        addToSpatialBin(bins[b], leftPart);
+                    rest = rightPart;
+                    restValid = rightValid;
+                }
+                if (restValid)
+                    addToSpatialBin(bins[last], rest);
+                bins[first].enter++;
+                bins[last].exit++;
+            }
+
+            // bounds and counts of the right side of every plane, then sweep the left side
+            BoundingBox rightBboxes[nSpatialBins];
+            bool rightValid[nSpatialBins];
+            BoundingBox rightBbox;
+            bool valid = false;
+            for (int b = nSpatialBins - 1; b > 0; b--)
+            {
+                if (bins[b].valid)
+                {
+                    rightBbox = valid ? getTotalBoundingBox(rightBbox, bins[b].boundingBox) : bins[b].boundingBox;
+                    valid = true;
+                }
+                rightBboxes[b] = rightBbox;
+                rightValid[b] = valid;
+            }
+            BoundingBox leftBbox;
+            bool leftValid = false;
+            int leftCount = 0, rightCount = nItems;
+            for (int b = 0; b < nSpatialBins - 1; b++)
+            {
+                if (bins[b].valid)
+                {
+                    leftBbox = leftValid ? getTotalBoundingBox(leftBbox, bins[b].boundingBox) : bins[b].boundingBox;
+                    leftValid = true;
+                }
+                leftCount += bins[b].enter;
+                rightCount -= bins[b].exit;
+                if (leftCount == 0 || rightCount == 0 || !leftValid || !rightValid[b + 1] ||
+                    leftCount + rightCount - nItems > budget)
+                    continue;
+                float cost = traversalCost + (leftCount * leftBbox.surfaceArea() +
+                                              rightCount * rightBboxes[b + 1].surfaceArea()) /
+                                                 bbox.surfaceArea();
+                if (cost < minCost)
+                {
+                    minCost = cost;
+                    minCostDim = axis;
+                    minCostPosition = bbox.Pmin[axis] + (b + 1) * binSize;
+                }
+            }
+        }
+        return minCost;
+    }
+
+    static void addToSpatialBin(SpatialBin &bin, const BoundingBox &bbox)
+    {
+        bin.boundingBox = bin.valid ? getTotalBoundingBox(bin.boundingBox, bbox) : bbox;
+        bin.valid = true;
+    }
+
+    // Distributes the references between the sides of the plane. A straddling reference is split
+    // in two, unless moving it whole to one side costs less, which saves a duplicate.
+    void splitReferences(const std::vector<BVH_Item> &references, int dim, float position,
+                         std::vector<BVH_Item> &left, std::vector<BVH_Item> &right)
+    {
+        struct Straddling
+        {
+            const BVH_Item *reference;
+            BoundingBox leftPart, rightPart;
+        };
+        std::vector<Straddling> straddling;
+        BoundingBox leftBbox, rightBbox;
+        bool leftValid = false, rightValid = false;
+        auto grow = [](BoundingBox &bbox, bool &valid, const BoundingBox &other)
+        {
+            bbox = valid ? getTotalBoundingBox(bbox, other) : other;
+            valid = true;
+        };
+        for (auto &&reference : references)
+        {
+            if (reference.boundingBox.Pmax[dim] <= position)
+            {
+                left.push_back(reference);
+                grow(leftBbox, leftValid, reference.boundingBox);
+            }
+            else if (reference.boundingBox.Pmin[dim] >= position)
+            {
+                right.push_back(reference);
+                grow(rightBbox, rightValid, reference.boundingBox);
+            }
+            else
+            {
+                Straddling part{&reference, {}, {}};
+                bool leftPartValid, rightPartValid;
+                splitReference(reference, reference.boundingBox, dim, position, part.leftPart, leftPartValid, part.rightPart, rightPartValid);
+                if (leftPartValid && rightPartValid)
+                {
+                    grow(leftBbox, leftValid, part.leftPart);
+                    grow(rightBbox, rightValid, part.rightPart);
+                    straddling.push_back(part);
+                }
+                else if (leftPartValid)
+                {
+                    left.push_back(BVH_Item(reference.index, part.leftPart));
+                    grow(leftBbox, leftValid, part.leftPart);
+                }
+                else
+                {
+                    right.push_back(BVH_Item(reference.index, part.rightPart));
+                    grow(rightBbox, rightValid, part.rightPart);
+                }
+            }
+        }
+
+        // reference unsplitting, costs in the units of the SAH split cost
+        int leftCount = left.size() + straddling.size();
+        int rightCount = right.size() + straddling.size();
+        for (auto &&part : straddling)
+        {
+            const BVH_Item &reference = *part.reference;
+            float splitCost = leftBbox.surfaceArea() * leftCount + rightBbox.surfaceArea() * rightCount;
+            BoundingBox leftUnsplit = getTotalBoundingBox(leftBbox, reference.boundingBox);
+            BoundingBox rightUnsplit = getTotalBoundingBox(rightBbox, reference.boundingBox);
+            float leftCost = leftUnsplit.surfaceArea() * leftCount + rightBbox.surfaceArea() * (rightCount - 1);
+            float rightCost = leftBbox.surfaceArea() * (leftCount - 1) + rightUnsplit.surfaceArea() * rightCount;
+            if (leftCost < splitCost && leftCost <= rightCost)
+            {
+                left.push_back(reference);
+                leftBbox = leftUnsplit;
+                rightCount--;
+            }
+            else if (rightCost < splitCost)
+            {
+                right.push_back(reference);
+                rightBbox = rightUnsplit;
+                leftCount--;
+            }
+            else
+            {
+                left.push_back(BVH_Item(reference.index, part.leftPart));
+                right.push_back(BVH_Item(reference.index, part.rightPart));
+            }
+        }
+    }
+
+    // Clips the object of the reference to both sides of the plane, within the reference bounds.
+    // Triangles are clipped edge by edge, a side is invalid when nothing of the object lies there.
+    void splitReference(const BVH_Item &reference, const BoundingBox &bbox, int dim, float position,
+                        BoundingBox &left, bool &leftValid, BoundingBox &right, bool &rightValid)
+    {
+        if (splitTriangles == nullptr)
+        {
+            left = bbox;
+            right = bbox;
         }
         else
         {
-            // Create leaf node
-            // std::cout << "Expensive bucket intersection." << std::endl;
-            int firstItemOffset = orderedObjects.size();
-            for (int i = start; i < end; ++i)
+            left = BoundingBox{glm::vec3(INFINITY), glm::vec3(-INFINITY)};
+            right = left;
+            const glm::vec3 *vertices = &(*splitTriangles)[3 * reference.index];
+            for (int i = 0; i < 3; i++)
             {
-                int itemIndex = items[i].index;
-                orderedObjects.push_back(itemIndex);
+                const glm::vec3 &v0 = vertices[i];
+                const glm::vec3 &v1 = vertices[(i + 1) % 3];
+                if (v0[dim] <= position)
+                    left = getTotalBoundingBox(left, v0);
+                if (v0[dim] >= position)
+                    right = getTotalBoundingBox(right, v0);
+                if ((v0[dim] < position && v1[dim] > position) || (v0[dim] > position && v1[dim] < position))
+                {
+                    glm::vec3 p = glm::mix(v0, v1, (position - v0[dim]) / (v1[dim] - v0[dim]));
+                    p[dim] = position;
+                    left = getTotalBoundingBox(left, p);
+                    right = getTotalBoundingBox(right, p);
+                }
             }
-            return createLeaf(firstItemOffset, nItems, bbox);
         }
+        left.Pmax[dim] = std::min(left.Pmax[dim], position);
+        right.Pmin[dim] = std::max(right.Pmin[dim], position);
+        left = BoundingBox{glm::max(left.Pmin, bbox.Pmin), glm::min(left.Pmax, bbox.Pmax)};
+        right = BoundingBox{glm::max(right.Pmin, bbox.Pmin), glm::min(right.Pmax, bbox.Pmax)};
+        leftValid = left.Pmin.x <= left.Pmax.x && left.Pmin.y <= left.Pmax.y && left.Pmin.z <= left.Pmax.z;
+        rightValid = right.Pmin.x <= right.Pmax.x && right.Pmin.y <= right.Pmax.y && right.Pmin.z <= right.Pmax.z;
     }
 
-    std::vector<std::shared_ptr<BVH_Node>> getBVHTree()
+    // runs f(chunk, begin, end) over nChunks contiguous chunks of [start, end), one thread per chunk
+    template <typename F>
+    static void parallelChunks(int start, int end, int nChunks, F f)
     {
-        // std::cout << "Starting BVH tree" << std::endl;
-        return getBVHSubTree(root);
+        int chunkSize = (end - start + nChunks - 1) / nChunks;
+        std::vector<std::thread> threads;
+        for (int c = 1; c < nChunks; c++)
+        {
+            int begin = std::min(end, start + c * chunkSize);
+            int chunkEnd = std::min(end, begin + chunkSize);
+            threads.emplace_back(f, c, begin, chunkEnd);
+        }
+        f(0, start, std::min(end, start + chunkSize));
+        for (auto &&thread : threads)
+            thread.join();
     }
 
-    std::vector<int> getOrderedObjects()
+    void parallelBuild()
     {
-        return orderedObjects;
+        numThreads = std::max(1u, std::thread::hardware_concurrency());
+        scratchItems = items;
+        // a subtree over n items owns 2n - 1 consecutive node slots: its root takes the first one,
+        // the first child subtree the following 2 * (mid - start) - 1 and the second child the rest,
+        // so subtrees can be built concurrently without sharing a node counter
+        std::vector<BVH_LinearNode> sparseNodes(2 * items.size() - 1);
+        usedNodes.assign(sparseNodes.size(), 0);
+        nodes.swap(sparseNodes);
+        switch (buildMode)
+        {
+        case LBVH:
+            sortByMortonCode();
+            emitLBVH(0, items.size(), 0, mortonBits - 1, 0);
+            break;
+        case HLBVH:
+            sortByMortonCode();
+            emitHLBVH();
+            break;
+        default:
+            parallelRecursiveBuild(0, items.size(), 0, 0);
+            break;
+        }
+        nodes.swap(sparseNodes);
+
+        // compact the unused slots away, the depth-first order is preserved
+        std::vector<int> newIndex(sparseNodes.size());
+        int nNodes = 0;
+        for (size_t i = 0; i < sparseNodes.size(); i++)
+        {
+            newIndex[i] = nNodes;
+            nNodes += usedNodes[i];
+        }
+        nodes.resize(nNodes);
+        for (size_t i = 0; i < sparseNodes.size(); i++)
+        {
+            if (!usedNodes[i])
+                continue;
+            BVH_LinearNode node = sparseNodes[i];
+            if (node.objectCount == 0)
+                node.offset = newIndex[node.offset];
+            nodes[newIndex[i]] = node;
+        }
+        scratchItems.clear();
+        scratchItems.shrink_to_fit();
+        mortonCodes.clear();
+        mortonCodes.shrink_to_fit();
+        usedNodes.clear();
     }
 
-private:
-    std::vector<BVH_Item> items;
-    std::vector<int> orderedObjects;
-    int maxNodeItems;
-    int totalNodes = 0;
+    // spreads the 10 low bits of x so that there are two zero bits between each of them
+    static uint32_t leftShift3(uint32_t x)
+    {
+        if (x == (1 << 10))
+            --x;
+        x = (x | (x << 16)) & 0x030000FF;
+        x = (x | (x << 8)) & 0x0300F00F;
+        x = (x | (x << 4)) & 0x030C30C3;
+        x = (x | (x << 2)) & 0x09249249;
+        return x;
+    }
 
-    std::shared_ptr<BVH_Node> root = nullptr;
-    std::vector<std::shared_ptr<BVH_Node>> tree;
+    static uint32_t encodeMorton3(const glm::vec3 &v)
+    {
+        return (leftShift3(v.z) << 2) | (leftShift3(v.y) << 1) | leftShift3(v.x);
+    }
 
-    std::shared_ptr<BVH_Node> createLeaf(int first, int n, BoundingBox bbox)
+    // computes the Morton code of every item centroid and sorts the items (and codes) by it
+    void sortByMortonCode()
     {
-        std::shared_ptr<BVH_Node> node = std::make_shared<BVH_Node>();
-        node->id = totalNodes;
-        totalNodes++;
-        node->objectOffset = first;
-        node->objectCount = n;
-        node->bbox = bbox;
-        node->children[0] = nullptr;
-        node->children[1] = nullptr;
-        // std::cout << "Created BVH leaf: " << node->id << " with object offset + count: " << node->objectOffset << ", " << node->objectCount << std::endl;
-        return node;
+        int nItems = items.size();
+        int nChunks = nItems >= parallelItemsThreshold ? numThreads : 1;
+
+        std::vector<BoundingBox> chunkCenterBboxes(nChunks);
+        parallelChunks(0, nItems, nChunks, [&](int c, int begin, int chunkEnd)
+                       {
+                           BoundingBox centerBbox{items[begin].center, items[begin].center};
+                           for (int i = begin + 1; i < chunkEnd; ++i)
+                               centerBbox = getTotalBoundingBox(centerBbox, items[i].center);
+                           chunkCenterBboxes[c] = centerBbox; });
+        BoundingBox centerBbox = chunkCenterBboxes[0];
+        for (int c = 1; c < nChunks; c++)
+            centerBbox = getTotalBoundingBox(centerBbox, chunkCenterBboxes[c]);
+
+        struct MortonItem
+        {
+            uint32_t mortonCode;
+            int itemIndex;
+        };
+        std::vector<MortonItem> mortonItems(nItems), sortedItems(nItems);
+        constexpr int mortonScale = 1 << 10;
+        parallelChunks(0, nItems, nChunks, [&](int, int begin, int chunkEnd)
+                       {
+                           for (int i = begin; i < chunkEnd; ++i)
+                           {
+                               glm::vec3 offset = centerBbox.offset(items[i].center);
+                               mortonItems[i].mortonCode = encodeMorton3(offset * float(mortonScale));
+                               mortonItems[i].itemIndex = i;
+                           } });
+
+        // Parallel LSD radix sort: every chunk histograms its digits, the offsets are laid out
+        // digit-major then chunk-major so the scatter stays stable
+        constexpr int nDigits = 1 << radixBitsPerPass;
+        std::vector<std::array<int, nDigits>> histograms(nChunks);
+        for (int lowBit = 0; lowBit < mortonBits; lowBit += radixBitsPerPass)
+        {
+            uint32_t mask = (1 << radixBitsPerPass) - 1;
+            parallelChunks(0, nItems, nChunks, [&](int c, int begin, int chunkEnd)
+                           {
+                               histograms[c].fill(0);
+                               for (int i = begin; i < chunkEnd; ++i)
+                                   histograms[c][(mortonItems[i].mortonCode >> lowBit) & mask]++; });
+            int offset = 0;
+            for (int d = 0; d < nDigits; d++)
+            {
+                for (int c = 0; c < nChunks; c++)
+                {
+                    int count = histograms[c][d];
+                    histograms[c][d] = offset;
+                    offset += count;
+                }
+            }
+            parallelChunks(0, nItems, nChunks, [&](int c, int begin, int chunkEnd)
+                           {
+                               for (int i = begin; i < chunkEnd; ++i)
+                                   sortedItems[histograms[c][(mortonItems[i].mortonCode >> lowBit) & mask]++] = mortonItems[i]; });
+            mortonItems.swap(sortedItems);
+        }
+
+        // reorder the items themselves, so every subtree covers a contiguous range
+        scratchItems = items;
+        mortonCodes.resize(nItems);
+        parallelChunks(0, nItems, nChunks, [&](int, int begin, int chunkEnd)
+                       {
+                           for (int i = begin; i < chunkEnd; ++i)
+                           {
+                               items[i] = scratchItems[mortonItems[i].itemIndex];
+                               mortonCodes[i] = mortonItems[i].mortonCode;
+                           } });
     }
 
-    std::shared_ptr<BVH_Node> createNode(int id, std::shared_ptr<BVH_Node> c0, std::shared_ptr<BVH_Node> c1)
+    // Emits the subtree of the Morton sorted items [start, end) into its node slots, splitting
+    // where bitIndex (or the first lower bit that differs in the range) flips.
+    void emitLBVH(int start, int end, int nodeIndex, int bitIndex, int depth)
     {
-        std::shared_ptr<BVH_Node> node = std::make_shared<BVH_Node>();
-        node->id = id;
-        node->children[0] = c0;
-        node->children[1] = c1;
-        node->bbox = getTotalBoundingBox(c0->bbox, c1->bbox);
-        node->objectCount = 0;
-        // std::cout << "Created BVH node: " << node->id << " with children: " << c0->id << ", " << c1->id << std::endl;
-        return node;
+        usedNodes[nodeIndex] = 1;
+        int nItems = end - start;
+
+        // like the SAH cost model with a single item per leaf, except for items sharing a code
+        if (nItems == 1 || (bitIndex < 0 && nItems <= maxLeafItems))
+        {
+            BoundingBox bbox = items[start].boundingBox;
+            for (int i = start + 1; i < end; ++i)
+                bbox = getTotalBoundingBox(bbox, items[i].boundingBox);
+            createLeaf(nodeIndex, start, end, bbox);
+            return;
+        }
+
+        int mid = (start + end) / 2;
+        int axis = 0;
+        if (bitIndex >= 0)
+        {
+            // skip the bits shared by the whole range
+            uint32_t mask = 1 << bitIndex;
+            if ((mortonCodes[start] & mask) == (mortonCodes[end - 1] & mask))
+            {
+                emitLBVH(start, end, nodeIndex, bitIndex - 1, depth);
+                return;
+            }
+            // the range is sorted, find the first item with the bit set
+            mid = std::partition_point(&mortonCodes[start], &mortonCodes[end - 1] + 1,
+                                       [mask](uint32_t code)
+                                       { return (code & mask) == 0; }) -
+                  &mortonCodes[0];
+            axis = bitIndex % 3;
+        }
+
+        int secondChild = nodeIndex + 2 * (mid - start);
+        if (nItems >= forkItemsThreshold && depth < 16 && (1u << depth) < numThreads)
+        {
+            auto firstChild = std::async(std::launch::async, [=]()
+                                         { emitLBVH(start, mid, nodeIndex + 1, bitIndex - 1, depth + 1); });
+            emitLBVH(mid, end, secondChild, bitIndex - 1, depth + 1);
+            firstChild.get();
+        }
+        else
+        {
+            emitLBVH(start, mid, nodeIndex + 1, bitIndex - 1, depth + 1);
+            emitLBVH(mid, end, secondChild, bitIndex - 1, depth + 1);
+        }
+        createNode(nodeIndex, secondChild, axis, getChildrenBoundingBox(nodeIndex, secondChild));
     }
 
-    BoundingBox getTotalBoundingBox(BoundingBox bbox1, BoundingBox bbox2)
+    // HLBVH: the runs of items sharing their top Morton bits are built as LBVH treelets,
+    // and the levels above them with SAH over the treelet bounds
+    void emitHLBVH()
+    {
+        int nItems = items.size();
+        uint32_t treeletMask = ((1u << treeletBits) - 1) << (mortonBits - treeletBits);
+        std::vector<int> treeletStart, treeletCount;
+        std::vector<BoundingBox> treeletBboxes;
+        for (int start = 0, end = 1; end <= nItems; end++)
+        {
+            if (end < nItems && (mortonCodes[start] & treeletMask) == (mortonCodes[end] & treeletMask))
+                continue;
+            BoundingBox bbox = items[start].boundingBox;
+            for (int i = start + 1; i < end; ++i)
+                bbox = getTotalBoundingBox(bbox, items[i].boundingBox);
+            treeletStart.push_back(start);
+            treeletCount.push_back(end - start);
+            treeletBboxes.push_back(bbox);
+            start = end;
+        }
+
+        BVH_Accelerator upper;
+        upper.buildMode = SAH;
+        upper.logBuilds = false;
+        upper.buildTree(treeletBboxes, 1);
+        const std::vector<BVH_LinearNode> &upperNodes = upper.getBVHTree();
+        std::vector<int> upperTreelets = upper.getOrderedObjects();
+
+        // lay the treelets out in the order of the upper tree leaves, keeping Morton order
+        // inside a leaf so its items can still be split by their codes
+        for (auto &&node : upperNodes)
+            if (node.objectCount > 1)
+                std::sort(&upperTreelets[node.offset], &upperTreelets[node.offset] + node.objectCount);
+        scratchItems = items;
+        std::vector<uint32_t> scratchCodes = mortonCodes;
+        int offset = 0;
+        for (auto &&treelet : upperTreelets)
+        {
+            std::copy(&scratchItems[treeletStart[treelet]], &scratchItems[treeletStart[treelet]] + treeletCount[treelet], &items[offset]);
+            std::copy(&scratchCodes[treeletStart[treelet]], &scratchCodes[treeletStart[treelet]] + treeletCount[treelet], &mortonCodes[offset]);
+            offset += treeletCount[treelet];
+        }
+
+        // items under every upper node, children always come after their parent
+        std::vector<int> upperItems(upperNodes.size());
+        for (int i = upperNodes.size() - 1; i >= 0; i--)
+        {
+            const BVH_LinearNode &node = upperNodes[i];
+            if (node.objectCount > 0)
+            {
+                upperItems[i] = 0;
+                for (int t = node.offset; t < node.offset + node.objectCount; t++)
+                    upperItems[i] += treeletCount[upperTreelets[t]];
+            }
+            else
+                upperItems[i] = upperItems[i + 1] + upperItems[node.offset];
+        }
+
+        emitUpperSAH(upperNodes, upperItems, 0, 0, 0, 0);
+    }
+
+    void emitUpperSAH(const std::vector<BVH_LinearNode> &upperNodes, const std::vector<int> &upperItems,
+                      int upperIndex, int start, int nodeIndex, int depth)
+    {
+        const BVH_LinearNode &upperNode = upperNodes[upperIndex];
+        if (upperNode.objectCount > 0)
+        {
+            emitLBVH(start, start + upperItems[upperIndex], nodeIndex, mortonBits - 1, depth);
+            return;
+        }
+
+        usedNodes[nodeIndex] = 1;
+        int mid = start + upperItems[upperIndex + 1];
+        int secondChild = nodeIndex + 2 * (mid - start);
+        if (upperItems[upperIndex] >= forkItemsThreshold && depth < 16 && (1u << depth) < numThreads)
+        {
+            auto firstChild = std::async(std::launch::async, [&, upperIndex, start, nodeIndex, depth]()
+                                         { emitUpperSAH(upperNodes, upperItems, upperIndex + 1, start, nodeIndex + 1, depth + 1); });
+            emitUpperSAH(upperNodes, upperItems, upperNode.offset, mid, secondChild, depth + 1);
+            firstChild.get();
+        }
+        else
+        {
+            emitUpperSAH(upperNodes, upperItems, upperIndex + 1, start, nodeIndex + 1, depth + 1);
+            emitUpperSAH(upperNodes, upperItems, upperNode.offset, mid, secondChild, depth + 1);
+        }
+        createNode(nodeIndex, secondChild, upperNode.splitAxis, getChildrenBoundingBox(nodeIndex, secondChild));
+    }
+
+    BoundingBox getChildrenBoundingBox(int nodeIndex, int secondChild)
+    {
+        BoundingBox bbox0{nodes[nodeIndex + 1].Pmin, nodes[nodeIndex + 1].Pmax};
+        BoundingBox bbox1{nodes[secondChild].Pmin, nodes[secondChild].Pmax};
+        return getTotalBoundingBox(bbox0, bbox1);
+    }
+
+    void parallelRecursiveBuild(int start, int end, int nodeIndex, int depth)
+    {
+        usedNodes[nodeIndex] = 1;
+        int nItems = end - start;
+        // upper levels share the cores between the concurrently built subtrees
+        int nChunks = nItems >= parallelItemsThreshold && depth < 16 ? std::max(1, int(numThreads >> depth)) : 1;
+
+        // Compute bounds of all primitives and of their centroids
+        std::vector<BoundingBox> chunkBboxes(nChunks), chunkCenterBboxes(nChunks);
+        parallelChunks(start, end, nChunks, [&](int c, int begin, int chunkEnd)
+                       {
+                           BoundingBox bbox = items[begin].boundingBox;
+                           BoundingBox centerBbox{items[begin].center, items[begin].center};
+                           for (int i = begin + 1; i < chunkEnd; ++i)
+                           {
+                               bbox = getTotalBoundingBox(bbox, items[i].boundingBox);
+                               centerBbox = getTotalBoundingBox(centerBbox, items[i].center);
+                           }
+                           chunkBboxes[c] = bbox;
+                           chunkCenterBboxes[c] = centerBbox; });
+        BoundingBox bbox = chunkBboxes[0];
+        BoundingBox centerBbox = chunkCenterBboxes[0];
+        for (int c = 1; c < nChunks; c++)
+        {
+            bbox = getTotalBoundingBox(bbox, chunkBboxes[c]);
+            centerBbox = getTotalBoundingBox(centerBbox, chunkCenterBboxes[c]);
+        }
+
+        if (nItems == 1)
+        {
+            createLeaf(nodeIndex, start, end, bbox);
+            return;
+        }
+
+        int dim = centerBbox.maximumExtent();
+        if (centerBbox.Pmax[dim] == centerBbox.Pmin[dim] && nItems <= maxLeafItems)
+        {
+            createLeaf(nodeIndex, start, end, bbox);
+            return;
+        }
+
+        int mid = (start + end) / 2;
+        if (nItems <= 4 || centerBbox.Pmax[dim] == centerBbox.Pmin[dim])
+        {
+            // Partition primitives into equally sized subsets
+            std::nth_element(&items[start], &items[mid],
+                             &items[end - 1] + 1,
+                             [dim](const BVH_Item &a, const BVH_Item &b)
+                             {
+                                 return a.center[dim] < b.center[dim];
+                             });
+        }
+        else
+        {
+            // Bin the centroids, one set of buckets per chunk
+            std::vector<std::array<BucketInfo, nBuckets>> chunkBuckets(nChunks);
+            parallelChunks(start, end, nChunks, [&](int c, int begin, int chunkEnd)
+                           {
+                               for (int i = begin; i < chunkEnd; ++i)
+                                   addToBucket(chunkBuckets[c][getBucket(centerBbox, dim, items[i].center)], items[i]); });
+            BucketInfo buckets[nBuckets];
+            for (int c = 0; c < nChunks; c++)
+                for (int b = 0; b < nBuckets; b++)
+                    mergeBucket(buckets[b], chunkBuckets[c][b]);
+
+            int minCostSplitBucket;
+            float minCost = findSAHSplit(buckets, bbox, minCostSplitBucket);
+
+            // Either create leaf or split primitives at selected SAH bucket
+            float leafCost = nItems;
+            if (nItems <= maxNodeItems && nItems <= maxLeafItems && minCost >= leafCost)
+            {
+                createLeaf(nodeIndex, start, end, bbox);
+                return;
+            }
+            mid = parallelPartition(start, end, nChunks, [&](const BVH_Item &pi)
+                                    { return getBucket(centerBbox, dim, pi.center) <= minCostSplitBucket; });
+        }
+
+        // Build the two subtrees, the first one on a new task when it is big enough
+        int secondChild = nodeIndex + 2 * (mid - start);
+        if (nItems >= forkItemsThreshold && depth < 16 && (1u << depth) < numThreads)
+        {
+            auto firstChild = std::async(std::launch::async, [=]()
+                                         { parallelRecursiveBuild(start, mid, nodeIndex + 1, depth + 1); });
+            parallelRecursiveBuild(mid, end, secondChild, depth + 1);
+            firstChild.get();
+        }
+        else
+        {
+            parallelRecursiveBuild(start, mid, nodeIndex + 1, depth + 1);
+            parallelRecursiveBuild(mid, end, secondChild, depth + 1);
+        }
+        createNode(nodeIndex, secondChild, dim, bbox);
+    }
+
+    // Partitions items [start, end) through the scratch buffer: every chunk counts its items on
+    // each side, then scatters them to their final position. Returns the first item of the second side.
+    template <typename P>
+    int parallelPartition(int start, int end, int nChunks, P pred)
+    {
+        if (nChunks == 1)
+            return std::partition(&items[start], &items[end - 1] + 1, pred) - &items[0];
+
+        std::vector<int> leftCounts(nChunks, 0), rightCounts(nChunks, 0);
+        parallelChunks(start, end, nChunks, [&](int c, int begin, int chunkEnd)
+                       {
+                           for (int i = begin; i < chunkEnd; ++i)
+                           {
+                               if (pred(items[i]))
+                                   leftCounts[c]++;
+                               else
+                                   rightCounts[c]++;
+                           } });
+        std::vector<int> leftOffsets(nChunks), rightOffsets(nChunks);
+        int nLeft = 0;
+        for (int c = 0; c < nChunks; c++)
+        {
+            leftOffsets[c] = start + nLeft;
+            nLeft += leftCounts[c];
+        }
+        int nRight = 0;
+        for (int c = 0; c < nChunks; c++)
+        {
+            rightOffsets[c] = start + nLeft + nRight;
+            nRight += rightCounts[c];
+        }
+        parallelChunks(start, end, nChunks, [&](int c, int begin, int chunkEnd)
+                       {
+                           int left = leftOffsets[c], right = rightOffsets[c];
+                           for (int i = begin; i < chunkEnd; ++i)
+                           {
+                               if (pred(items[i]))
+                                   scratchItems[left++] = items[i];
+                               else
+                                   scratchItems[right++] = items[i];
+                           } });
+        parallelChunks(start, end, nChunks, [&](int, int begin, int chunkEnd)
+                       { std::copy(&scratchItems[begin], &scratchItems[chunkEnd - 1] + 1, &items[begin]); });
+        return start + nLeft;
+    }
+
+    int createLeaf(int nodeIndex, int start, int end, BoundingBox bbox)
+    {
+        BVH_LinearNode &node = nodes[nodeIndex];
+        node.Pmin = bbox.Pmin;
+        node.Pmax = bbox.Pmax;
+        node.offset = start;
+        node.objectCount = end - start;
+        node.splitAxis = 0;
+        // std::cout << "Created BVH leaf: " << nodeIndex << " with object offset + count: " << node.offset << ", " << node.objectCount << std::endl;
+        return nodeIndex;
+    }
+
+    int createNode(int nodeIndex, int secondChild, int axis, BoundingBox bbox)
+    {
+        BVH_LinearNode &node = nodes[nodeIndex];
+        node.Pmin = bbox.Pmin;
+        node.Pmax = bbox.Pmax;
+        node.offset = secondChild;
+        node.objectCount = 0;
+        node.splitAxis = axis;
+        // std::cout << "Created BVH node: " << nodeIndex << " with children: " << nodeIndex + 1 << ", " << secondChild << std::endl;
+        return nodeIndex;
+    }
+
+    static BoundingBox getTotalBoundingBox(BoundingBox bbox1, BoundingBox bbox2)
     {
         BoundingBox bbox;
         glm::vec3 minPoint = glm::min(bbox1.Pmin, bbox2.Pmin);
@@ -287,7 +1242,7 @@ private:
         return bbox;
     }
 
-    BoundingBox getTotalBoundingBox(BoundingBox bbox1, glm::vec3 p)
+    static BoundingBox getTotalBoundingBox(BoundingBox bbox1, glm::vec3 p)
     {
         BoundingBox bbox;
         glm::vec3 minPoint = glm::min(bbox1.Pmin, p);
@@ -296,19 +1251,5 @@ private:
         bbox.Pmin = minPoint;
         return bbox;
     }
-
-    std::vector<std::shared_ptr<BVH_Node>> getBVHSubTree(std::shared_ptr<BVH_Node> node)
-    {
-        std::vector<std::shared_ptr<BVH_Node>> nodeTree = {node};
-        if (node->children[0] == nullptr)
-        {
-            return nodeTree;
-        }
-        auto rightTree = getBVHSubTree(node->children[0]);
-        auto leftTree = getBVHSubTree(node->children[1]);
-        nodeTree.insert(nodeTree.end(), rightTree.begin(), rightTree.end());
-        nodeTree.insert(nodeTree.end(), leftTree.begin(), leftTree.end());
-        return nodeTree;
-    }
 };
 #endif
@@ -0,0 +1,238 @@
+// On-disk cache of imported meshes and their BLAS. Every file holds the vertices and indices of
+// one mesh and its BLAS built with one set of builder parameters. Files are named after the
+// content hash of the source asset and the parameters, and are mapped when loaded, so a warm
+// start uses the mesh in place and copies the BLAS out of the page cache instead of parsing the
+// model and building the tree.
+
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <random>
+#include <filesystem>
+
+#include <mesh.h>
+#include <mapped_file.h>
+#include <bvh_accelerator.h>
+
+// File layout: header, BLAS nodes, vertices, mesh indices, BLAS triangle indices. Every array
+// starts aligned to its element size.
+struct BVH_CacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t buildMode;
+    uint64_t contentHash;
+    uint32_t maxNodeItems;
+    uint32_t pad;
+    uint64_t nodeCount;
+    uint64_t vertexCount;
+    uint64_t indexCount;
+    uint64_t triangleIndexCount; // three per BLAS leaf item, in BLAS order
+};
+static_assert(sizeof(BVH_CacheHeader) == 64, "BVH_CacheHeader must keep the arrays aligned");
+
+class BVH_Cache
+{
+public:
+    // bump when the file layout, the importer or a builder changes, older files are ignored
+    static constexpr uint32_t version = 2;
+
+    // directory of the cache files, empty disables the cache
+    static void setDirectory(const std::string &directory)
+    {
+        std::lock_guard<std::mutex> lock(getMutex());
+        getDirectoryPath() = directory;
+    }
+
+    static std::string getDirectory()
+    {
+        std::lock_guard<std::mutex> lock(getMutex());
+        return getDirectoryPath();
+    }
+
+    static bool isEnabled()
+    {
+        return !getDirectory().empty();
+    }
+
+    // FNV-1a over the 8 byte words of the data, then its tail and size. Never 0, which marks meshes
+    // without a source.
+    static uint64_t hashBytes(const char *data, size_t size)
+    {
+        const uint64_t prime = 0x100000001b3ull;
+        uint64_t hash = 0xcbf29ce484222325ull;
+        size_t words = size / sizeof(uint64_t);
+        for (size_t i = 0; i < words; i++)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + i * sizeof(uint64_t), sizeof(word));
+            hash = (hash ^ word) * prime;
+        }
+        for (size_t i = words * sizeof(uint64_t); i < size; i++)
+            hash = (hash ^ uint8_t(data[i])) * prime;
+        hash = (hash ^ size) * prime;
+        return hash != 0 ? hash : 1;
+    }
+
+    // content hash of a source asset, 0 when it cannot be read
+    static uint64_t hashFile(const std::string &path)
+    {
+        MappedFile file(path);
+        return file.isOpen() ? hashBytes(file.data(), file.size()) : 0;
+    }
+
+    // Mesh stored with the content hash by any BLAS build, nullptr when there is none. The
+    // returned mesh keeps the hash.
+    static std::shared_ptr<Mesh> loadMesh(uint64_t contentHash)
+    {
+        std::string directory = getDirectory();
+        std::error_code error;
+        if (directory.empty() || !std::filesystem::is_directory(directory, error))
+            return nullptr;
+        std::string prefix = hashName(contentHash) + "_";
+        for (auto &&entry : std::filesystem::directory_iterator(directory, error))
+        {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0 || entry.path().extension() != ".bvh")
+                continue;
+            std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(entry.path().string());
+            const BVH_CacheHeader *header = readHeader(*file, contentHash);
+            if (header == nullptr)
+                continue;
+            // the mesh arrays point into the mapping and keep it alive
+            const char *data = file->data() + sizeof(BVH_CacheHeader) + header->nodeCount * sizeof(BVH_LinearNode);
+            const Vertex *vertices = reinterpret_cast<const Vertex *>(data);
+            const unsigned int *indices = reinterpret_cast<const unsigned int *>(data + header->vertexCount * sizeof(Vertex));
+            std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>(MeshArray<Vertex>(vertices, header->vertexCount, file),
+                                                                MeshArray<unsigned int>(indices, header->indexCount, file));
+            mesh->contentHash = contentHash;
+            return mesh;
+        }
+        return nullptr;
+    }
+
+    // BLAS of the mesh for the builder parameters. False when it is not cached or the file
+    // does not match the mesh.
+    static bool loadBLAS(const Mesh &mesh, BVH_Build_Mode buildMode, int maxNodeItems,
+                         std::vector<BVH_LinearNode> &nodes, std::vector<unsigned int> &triangleIndices)
+    {
+        if (mesh.contentHash == 0 || !isEnabled())
+            return false;
+        MappedFile file(getPath(mesh.contentHash, buildMode, maxNodeItems));
+        const BVH_CacheHeader *header = readHeader(file, mesh.contentHash);
+        if (header == nullptr || header->buildMode != uint32_t(buildMode) || header->maxNodeItems != uint32_t(maxNodeItems) ||
+            header->vertexCount != mesh.vertices.size() || header->indexCount != mesh.indices.size())
+            return false;
+
+        const char *data = file.data() + sizeof(BVH_CacheHeader);
+        const BVH_LinearNode *fileNodes = reinterpret_cast<const BVH_LinearNode *>(data);
+        data += header->nodeCount * sizeof(BVH_LinearNode) + header->vertexCount * sizeof(Vertex) + header->indexCount * sizeof(unsigned int);
+        const unsigned int *fileIndices = reinterpret_cast<const unsigned int *>(data);
+        nodes.assign(fileNodes, fileNodes + header->nodeCount);
+        triangleIndices.assign(fileIndices, fileIndices + header->triangleIndexCount);
+        return true;
+    }
+
+    // Writes the mesh and its BLAS. The file is written under a temporary name and renamed, so
+    // other processes never map a partial file.
+    static void store(const Mesh &mesh, BVH_Build_Mode buildMode, int maxNodeItems,
+                      const std::vector<BVH_LinearNode> &nodes, const std::vector<unsigned int> &triangleIndices)
+    {
+        std::string directory = getDirectory();
+        if (mesh.contentHash == 0 || directory.empty())
+            return;
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+
+        BVH_CacheHeader header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+        header.version = version;
+        header.buildMode = buildMode;
+        header.contentHash = mesh.contentHash;
+        header.maxNodeItems = maxNodeItems;
+        header.nodeCount = nodes.size();
+        header.vertexCount = mesh.vertices.size();
+        header.indexCount = mesh.indices.size();
+        header.triangleIndexCount = triangleIndices.size();
+
+        std::string path = getPath(mesh.contentHash, buildMode, maxNodeItems);
+        std::ostringstream temporaryPath;
+        temporaryPath << path << "." << std::hex << std::random_device()() << ".tmp";
+        {
+            std::ofstream file(temporaryPath.str(), std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char *>(nodes.data()), nodes.size() * sizeof(BVH_LinearNode));
+            file.write(reinterpret_cast<const char *>(mesh.vertices.data()), mesh.vertices.size() * sizeof(Vertex));
+            file.write(reinterpret_cast<const char *>(mesh.indices.data()), mesh.indices.size() * sizeof(unsigned int));
+            file.write(reinterpret_cast<const char *>(triangleIndices.data()), triangleIndices.size() * sizeof(unsigned int));
+            if (!file)
+            {
+                std::cout << "ERROR::BVH_CACHE::Could not write " << temporaryPath.str() << std::endl;
+                file.close();
+                std::remove(temporaryPath.str().c_str());
+                return;
+            }
+        }
+        std::filesystem::rename(temporaryPath.str(), path, error);
+        if (error)
+        {
+            std::cout << "ERROR::BVH_CACHE::Could not write " << path << std::endl;
+            std::remove(temporaryPath.str().c_str());
+        }
+    }
+
+private:
+    static constexpr char fileMagic[8] = {'R', 'T', 'B', 'V', 'H', 'C', 0, 0};
+
+    static std::string &getDirectoryPath()
+    {
+        static std::string directory;
+        return directory;
+    }
+
+    static std::mutex &getMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::string hashName(uint64_t contentHash)
+    {
+        std::ostringstream name;
+        name << std::hex << std::setw(16) << std::setfill('0') << contentHash;
+        return name.str();
+    }
+
+    static std::string getPath(uint64_t contentHash, BVH_Build_Mode buildMode, int maxNodeItems)
+    {
+        std::ostringstream name;
+        name << hashName(contentHash) << "_" << int(buildMode) << "_" << maxNodeItems << ".bvh";
+        return (std::filesystem::path(getDirectory()) / name.str()).string();
+    }
+
+    // header of a complete file of the current version for the content hash, nullptr otherwise
+    static const BVH_CacheHeader *readHeader(const MappedFile &file, uint64_t contentHash)
+    {
+        if (!file.isOpen() || file.size() < sizeof(BVH_CacheHeader))
+            return nullptr;
+        const BVH_CacheHeader *header = reinterpret_cast<const BVH_CacheHeader *>(file.data());
+        if (std::memcmp(header->magic, fileMagic, sizeof(fileMagic)) != 0 || header->version != version ||
+            header->contentHash != contentHash)
+            return nullptr;
+        uint64_t size = sizeof(BVH_CacheHeader) + header->nodeCount * sizeof(BVH_LinearNode) + header->vertexCount * sizeof(Vertex) +
+                        (header->indexCount + header->triangleIndexCount) * sizeof(unsigned int);
+        return size == file.size() ? header : nullptr;
+    }
+};
+#endif
@@ -0,0 +1,137 @@
+// Compressed BLAS nodes: 16 bytes instead of the 32 of BVH_LinearNode. Every interior node keeps
+// the boxes of its two children with 8 bits per coordinate, relative to its own box. The box of
+// a node is decoded from its parent while traversing, the root box is kept in full precision in
+// two header nodes in front of every tree.
+
+#ifndef BVH_QUANTIZED_H
+#define BVH_QUANTIZED_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include <bvh_accelerator.h>
+
+struct BVH_QuantizedNode
+{
+    // interior: child 0 min xyz, max xyz, then child 1, leaf: object count in the first 4 bytes
+    uint8_t childBounds[12];
+    // bits 0-29 interior: second child index, leaf: first object, bits 30-31: child 0/1 is a leaf
+    uint32_t offset;
+
+    static constexpr uint32_t indexMask = (1u << 30) - 1u;
+    static constexpr size_t headerNodes = 2;
+
+    uint32_t getIndex() const
+    {
+        return offset & indexMask;
+    }
+
+    bool isLeafChild(int child) const
+    {
+        return (offset >> (30 + child)) & 1u;
+    }
+
+    uint32_t getObjectCount() const
+    {
+        uint32_t count;
+        std::memcpy(&count, childBounds, sizeof(count));
+        return count;
+    }
+
+    // box of a child inside the frame of this node, the shader decodes it the same way
+    void decodeChild(int child, const glm::vec3 &frameMin, const glm::vec3 &frameMax, glm::vec3 &pMin, glm::vec3 &pMax) const
+    {
+        glm::vec3 scale = (frameMax - frameMin) * (1.0f / 255.0f);
+        const uint8_t *q = childBounds + 6 * child;
+        pMin = frameMin + glm::vec3(q[0], q[1], q[2]) * scale;
+        pMax = frameMin + glm::vec3(q[3], q[4], q[5]) * scale;
+    }
+
+    // root box and whether the root is a leaf, from the two header nodes of a tree
+    static void decodeHeader(const BVH_QuantizedNode *header, glm::vec3 &pMin, glm::vec3 &pMax, bool &rootIsLeaf)
+    {
+        float bounds[6];
+        std::memcpy(bounds, header[0].childBounds, 3 * sizeof(float));
+        std::memcpy(bounds + 3, header[1].childBounds, 3 * sizeof(float));
+        pMin = glm::vec3(bounds[0], bounds[1], bounds[2]);
+        pMax = glm::vec3(bounds[3], bounds[4], bounds[5]);
+        rootIsLeaf = header[0].offset & 1u;
+    }
+
+    // Writes the headers and the quantized nodes of the binary tree nodes[0, count) to
+    // out[0, count + headerNodes). Interior offsets of the binary tree are relative to nodeBase,
+    // the quantized ones to quantizedBase, the index of out[0]. Leaf offsets are kept.
+    static void quantizeTree(const BVH_LinearNode *nodes, size_t count, int nodeBase, int quantizedBase, BVH_QuantizedNode *out)
+    {
+        // header: Pmin and the root leaf flag, then Pmax
+        std::memset(out, 0, headerNodes * sizeof(BVH_QuantizedNode));
+        std::memcpy(out[0].childBounds, &nodes[0].Pmin, 3 * sizeof(float));
+        std::memcpy(out[1].childBounds, &nodes[0].Pmax, 3 * sizeof(float));
+        out[0].offset = nodes[0].objectCount > 0 ? 1u : 0u;
+
+        // decoded box of every node, the frame its children are quantized in. Parents come first
+        // in depth first order, so the frames are known before they are needed.
+        std::vector<glm::vec3> frameMin(count), frameMax(count);
+        frameMin[0] = nodes[0].Pmin;
+        frameMax[0] = nodes[0].Pmax;
+        for (size_t i = 0; i < count; i++)
+        {
+            const BVH_LinearNode &node = nodes[i];
+            BVH_QuantizedNode &quantized = out[headerNodes + i];
+            if (node.objectCount > 0)
+            {
+                uint32_t objectCount = node.objectCount;
+                std::memset(quantized.childBounds, 0, sizeof(quantized.childBounds));
+                std::memcpy(quantized.childBounds, &objectCount, sizeof(objectCount));
+                quantized.offset = uint32_t(node.offset) & indexMask;
+                continue;
+            }
+            size_t children[2] = {i + 1, size_t(node.offset - nodeBase)};
+            quantized.offset = uint32_t(quantizedBase + headerNodes + children[1]) & indexMask;
+            for (int child = 0; child < 2; child++)
+            {
+                const BVH_LinearNode &childNode = nodes[children[child]];
+                quantizeChild(quantized, child, frameMin[i], frameMax[i], childNode.Pmin, childNode.Pmax);
+                quantized.decodeChild(child, frameMin[i], frameMax[i], frameMin[children[child]], frameMax[children[child]]);
+                if (childNode.objectCount > 0)
+                    quantized.offset |= 1u << (30 + child);
+            }
+        }
+    }
+
+private:
+    // Rounds the min corner down and the max corner up, then checks the decoded values so the
+    // decoded box always contains the child box
+    static void quantizeChild(BVH_QuantizedNode &node, int child, const glm::vec3 &frameMin, const glm::vec3 &frameMax,
+                              const glm::vec3 &pMin, const glm::vec3 &pMax)
+    {
+        glm::vec3 scale = (frameMax - frameMin) * (1.0f / 255.0f);
+        uint8_t *q = node.childBounds + 6 * child;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (scale[axis] <= 0.0f)
+            {
+                q[axis] = 0;
+                q[axis + 3] = 0;
+                continue;
+            }
+            int qMin = int(std::floor((pMin[axis] - frameMin[axis]) / scale[axis]));
+            int qMax = int(std::ceil((pMax[axis] - frameMin[axis]) / scale[axis]));
+            qMin = std::min(std::max(qMin, 0), 255);
+            qMax = std::min(std::max(qMax, 0), 255);
+            while (qMin > 0 && frameMin[axis] + qMin * scale[axis] > pMin[axis])
+                qMin--;
+            while (qMax < 255 && frameMin[axis] + qMax * scale[axis] < pMax[axis])
+                qMax++;
+            q[axis] = uint8_t(qMin);
+            q[axis + 3] = uint8_t(qMax);
+        }
+    }
+};
+static_assert(sizeof(BVH_QuantizedNode) == 16, "BVH_QuantizedNode must match the uvec4 of the compute shader");
+#endif
@@ -0,0 +1,367 @@
+// Two-level acceleration structure: one bottom-level BVH (BLAS) per Mesh, built once in
+// object space, and a top-level BVH (TLAS) over the object instances. Moving an object
+// only refits or rebuilds the TLAS, which has one item per object.
+
+#ifndef BVH_SCENE_ACCELERATOR_H
+#define BVH_SCENE_ACCELERATOR_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <memory>
+#include <map>
+#include <set>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include <object.h>
+#include <bvh_accelerator.h>
+#include <bvh_quantized.h>
+#include <bvh_cache.h>
+
+// Object placed in the scene. Rays are moved to object space with worldToObject and
+// traverse the BLAS whose root is blasNode, or whose header is quantizedBLASNode in the
+// quantized nodes. std430 layout, uploaded as is.
+struct BVH_Instance
+{
+    glm::mat4 worldToObject;
+    int blasNode;
+    int quantizedBLASNode;
+    int pad[2];
+};
+static_assert(sizeof(BVH_Instance) == 80, "BVH_Instance must match the std430 layout of the compute shader");
+
+class BVH_SceneAccelerator
+{
+public:
+    BVH_Build_Mode buildMode = PARALLEL_SAH;
+    // also keeps the BLAS as BVH_QuantizedNode, half the size of the BLAS nodes
+    bool quantizeBLAS = false;
+
+    // Builds the BLAS of the meshes seen for the first time and the TLAS over all the objects.
+    // Returns true when the bottom level (BLAS nodes, vertices or triangle indices) changed.
+    bool update(std::vector<std::shared_ptr<Object>> &objects)
+    {
+        bool bottomLevelChanged = updateBottomLevel(objects);
+        updateTopLevel(objects);
+        return bottomLevelChanged;
+    }
+
+    // TLAS nodes, leaves index the instances
+    const std::vector<BVH_LinearNode> &getTLASNodes() const
+    {
+        return tlasNodes;
+    }
+
+    const std::vector<BVH_Instance> &getInstances() const
+    {
+        return instances;
+    }
+
+    // BLAS nodes of every mesh, leaves index the triangles
+    const std::vector<BVH_LinearNode> &getBLASNodes() const
+    {
+        return blasNodes;
+    }
+
+    // quantized BLAS of every mesh, each one after its two header nodes. Empty unless quantizeBLAS
+    // is set and the scene fits the 30 bit offsets.
+    const std::vector<BVH_QuantizedNode> &getQuantizedBLASNodes() const
+    {
+        return quantizedBLASNodes;
+    }
+
+    // object space vertices of every mesh
+    const std::vector<Vertex> &getVertices() const
+    {
+        return vertices;
+    }
+
+    // three vertex indices per triangle, triangles in BLAS order
+    const std::vector<unsigned int> &getTriangleIndices() const
+    {
+        return triangleIndices;
+    }
+
+private:
+    struct BLAS
+    {
+        BVH_Build_Mode buildMode;
+        std::vector<BVH_LinearNode> nodes;
+        std::vector<unsigned int> triangleIndices; // mesh vertex indices, in BLAS order
+        int rootNode = 0;
+        int quantizedRootNode = 0; // first header node
+        BoundingBox bbox;
+    };
+
+    // the key keeps the mesh alive, so a pointer is never reused by another mesh
+    std::map<std::shared_ptr<Mesh>, BLAS> blasCache;
+    std::vector<BVH_LinearNode> blasNodes;
+    std::vector<BVH_QuantizedNode> quantizedBLASNodes;
+    bool quantizedBLAS = false; // quantizeBLAS of the last concatenation
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> triangleIndices;
+
+    BVH_Accelerator tlasAccelerator = BVH_Accelerator();
+    std::vector<Object *> tlasObjects; // objects the TLAS was built for, in item order
+    std::vector<BVH_LinearNode> tlasNodes;
+    std::vector<BVH_Instance> instances;
+
+    // objects handled by each thread when setting up instances
+    static constexpr size_t parallelObjectsThreshold = 1 << 12;
+    // meshes with fewer triangles are built side by side, bigger ones parallelize their own build
+    static constexpr size_t parallelBLASTriangles = 1 << 14;
+    static constexpr int blasMaxNodeItems = 5;
+
+    // lights are traced as analytic spheres, their mesh is only the wireframe gizmo
+    static bool hasGeometry(const std::shared_ptr<Object> &object)
+    {
+        return object->meshType != LIGHT && object->mesh != nullptr && object->mesh->getTriangleCount() > 0;
+    }
+
+    // runs f(begin, end) over contiguous ranges of [0, count), one thread per range of at least minCount
+    template <typename F>
+    static void parallelFor(size_t count, size_t minCount, F f)
+    {
+        size_t nThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), (count + minCount - 1) / minCount);
+        nThreads = std::max<size_t>(nThreads, 1);
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < nThreads; t++)
+            threads.emplace_back(f, count * t / nThreads, count * (t + 1) / nThreads);
+        f(0, count / nThreads);
+        for (auto &&thread : threads)
+            thread.join();
+    }
+
+    bool updateBottomLevel(std::vector<std::shared_ptr<Object>> &objects)
+    {
+        bool changed = false;
+        std::set<const Mesh *> usedMeshes;
+        for (auto &&object : objects)
+            if (hasGeometry(object))
+                usedMeshes.insert(object->mesh.get());
+
+        // forget the meshes that left the scene
+        for (auto it = blasCache.begin(); it != blasCache.end();)
+        {
+            if (usedMeshes.count(it->first.get()) > 0 && it->second.buildMode == buildMode)
+                ++it;
+            else
+            {
+                it = blasCache.erase(it);
+                changed = true;
+            }
+        }
+
+        // new meshes get their entry first, so the builds only write to their own BLAS
+        std::vector<std::pair<const Mesh *, BLAS *>> smallBuilds, largeBuilds;
+        size_t newTriangles = 0;
+        for (auto &&object : objects)
+        {
+            if (!hasGeometry(object) || blasCache.count(object->mesh) > 0)
+                continue;
+            auto build = std::make_pair(object->mesh.get(), &blasCache[object->mesh]);
+            if (object->mesh->getTriangleCount() < parallelBLASTriangles)
+                smallBuilds.push_back(build);
+            else
+                largeBuilds.push_back(build);
+            newTriangles += object->mesh->getTriangleCount();
+        }
+
+        if (!smallBuilds.empty() || !largeBuilds.empty())
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            std::atomic<size_t> nextBuild(0), cachedBuilds(0);
+            auto buildWorker = [&](size_t, size_t)
+            {
+                size_t i;
+                while ((i = nextBuild++) < smallBuilds.size())
+                    cachedBuilds += buildBLAS(*smallBuilds[i].first, *smallBuilds[i].second);
+            };
+            parallelFor(smallBuilds.size(), 1, buildWorker);
+            for (auto &&build : largeBuilds)
+                cachedBuilds += buildBLAS(*build.first, *build.second);
+            auto end = std::chrono::high_resolution_clock::now();
+            std::cout << "BLAS built: " << smallBuilds.size() + largeBuilds.size() << " meshes (" << cachedBuilds << " from the cache), "
+                      << newTriangles << " triangles in " << std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+            changed = true;
+        }
+
+        if (!changed && quantizedBLAS == quantizeBLAS)
+            return false;
+
+        // concatenate every BLAS into the shared node, vertex and index arrays. The arrays are sized
+        // up front and every mesh fills its own ranges, moving its offsets by the range starts.
+        struct Range
+        {
+            const Mesh *mesh;
+            BLAS *blas;
+            size_t nodeBase, triangleBase, vertexBase, quantizedBase;
+        };
+        std::vector<Range> ranges;
+        ranges.reserve(blasCache.size());
+        size_t nodeCount = 0, triangleCount = 0, vertexCount = 0;
+        for (auto &&entry : blasCache)
+        {
+            size_t quantizedBase = nodeCount + ranges.size() * BVH_QuantizedNode::headerNodes;
+            ranges.push_back(Range{entry.first.get(), &entry.second, nodeCount, triangleCount, vertexCount, quantizedBase});
+            entry.second.rootNode = nodeCount;
+            entry.second.quantizedRootNode = quantizedBase;
+            nodeCount += entry.second.nodes.size();
+            triangleCount += entry.second.triangleIndices.size() / 3;
+            vertexCount += entry.first->vertices.size();
+        }
+        blasNodes.resize(nodeCount);
+        vertices.resize(vertexCount);
+        triangleIndices.resize(3 * triangleCount);
+
+        // quantized offsets have 30 bits, bigger scenes keep the BLAS nodes only
+        quantizedBLAS = quantizeBLAS;
+        bool quantize = quantizeBLAS;
+        size_t quantizedCount = nodeCount + ranges.size() * BVH_QuantizedNode::headerNodes;
+        if (quantize && std::max(quantizedCount, triangleCount) > BVH_QuantizedNode::indexMask)
+        {
+            std::cout << "ERROR::BVH_SCENE_ACCELERATOR::Too many nodes or triangles to quantize the BLAS" << std::endl;
+            quantize = false;
+        }
+        quantizedBLASNodes.clear();
+        quantizedBLASNodes.resize(quantize ? quantizedCount : 0);
+
+        parallelFor(ranges.size(), 1, [&](size_t begin, size_t end)
+                    {
+                        for (size_t r = begin; r < end; r++)
+                        {
+                            const Range &range = ranges[r];
+                            const BLAS &blas = *range.blas;
+                            for (size_t i = 0; i < blas.nodes.size(); i++)
+                            {
+                                BVH_LinearNode node = blas.nodes[i];
+                                node.offset += node.objectCount > 0 ? range.triangleBase : range.nodeBase;
+                                blasNodes[range.nodeBase + i] = node;
+                            }
+                            if (quantize)
+                                BVH_QuantizedNode::quantizeTree(&blasNodes[range.nodeBase], blas.nodes.size(), range.nodeBase,
+                                                                range.quantizedBase, &quantizedBLASNodes[range.quantizedBase]);
+                            std::copy(range.mesh->vertices.begin(), range.mesh->vertices.end(), &vertices[range.vertexBase]);
+                            unsigned int *indices = &triangleIndices[3 * range.triangleBase];
+                            for (size_t i = 0; i < blas.triangleIndices.size(); i++)
+                                indices[i] = range.vertexBase + blas.triangleIndices[i];
+                        } });
+        return true;
+    }
+
+    // builds the BLAS of the mesh, or loads it from the BVH cache. Returns true when it was cached.
+    bool buildBLAS(const Mesh &mesh, BLAS &blas)
+    {
+        blas.buildMode = buildMode;
+        if (BVH_Cache::loadBLAS(mesh, buildMode, blasMaxNodeItems, blas.nodes, blas.triangleIndices))
+        {
+            blas.bbox = BoundingBox{blas.nodes[0].Pmin, blas.nodes[0].Pmax};
+            return true;
+        }
+
+        std::vector<BoundingBox> bboxes(mesh.getTriangleCount());
+        for (size_t i = 0; i < bboxes.size(); i++)
+        {
+            const glm::vec3 &p1 = mesh.vertices[mesh.indices[3 * i]].Position;
+            const glm::vec3 &p2 = mesh.vertices[mesh.indices[3 * i + 1]].Position;
+            const glm::vec3 &p3 = mesh.vertices[mesh.indices[3 * i + 2]].Position;
+            bboxes[i].Pmin = glm::min(glm::min(p1, p2), p3);
+            bboxes[i].Pmax = glm::max(glm::max(p1, p2), p3);
+        }
+
+        // spatial splits clip the triangles themselves
+        std::vector<glm::vec3> triangles;
+        if (buildMode == SBVH)
+        {
+            triangles.resize(mesh.indices.size());
+            for (size_t i = 0; i < triangles.size(); i++)
+                triangles[i] = mesh.vertices[mesh.indices[i]].Position;
+        }
+
+        BVH_Accelerator accelerator;
+        accelerator.buildMode = buildMode;
+        accelerator.logBuilds = false;
+        accelerator.buildTree(bboxes, blasMaxNodeItems, buildMode == SBVH ? &triangles : nullptr);
+
+        // triangles split by an SBVH are referenced by more than one leaf
+        blas.nodes = accelerator.getBVHTree();
+        const std::vector<int> &orderedTriangles = accelerator.getOrderedObjects();
+        blas.triangleIndices.resize(3 * orderedTriangles.size());
+        for (size_t i = 0; i < orderedTriangles.size(); i++)
+            std::copy(&mesh.indices[3 * orderedTriangles[i]], &mesh.indices[3 * orderedTriangles[i]] + 3, &blas.triangleIndices[3 * i]);
+        blas.bbox = BoundingBox{blas.nodes[0].Pmin, blas.nodes[0].Pmax};
+        BVH_Cache::store(mesh, buildMode, blasMaxNodeItems, blas.nodes, blas.triangleIndices);
+        return false;
+    }
+
+    void updateTopLevel(std::vector<std::shared_ptr<Object>> &objects)
+    {
+        std::vector<Object *> sceneObjects;
+        std::vector<const BLAS *> sceneBLAS;
+        for (auto &&object : objects)
+        {
+            if (!hasGeometry(object))
+                continue;
+            sceneObjects.push_back(object.get());
+            sceneBLAS.push_back(&blasCache[object->mesh]);
+        }
+
+        // instances are independent, large scenes set them up across threads
+        std::vector<BVH_Instance> objectInstances(sceneObjects.size());
+        std::vector<BoundingBox> bboxes(sceneObjects.size());
+        auto setUpInstances = [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                const BLAS &blas = *sceneBLAS[i];
+                glm::mat4 model = sceneObjects[i]->getModelMatrix();
+
+                // world bounds of the 8 transformed corners of the object space bounds
+                BoundingBox &bbox = bboxes[i];
+                for (int corner = 0; corner < 8; corner++)
+                {
+                    glm::vec3 point((corner & 1) ? blas.bbox.Pmax.x : blas.bbox.Pmin.x,
+                                    (corner & 2) ? blas.bbox.Pmax.y : blas.bbox.Pmin.y,
+                                    (corner & 4) ? blas.bbox.Pmax.z : blas.bbox.Pmin.z);
+                    point = model * glm::vec4(point, 1.0f);
+                    bbox.Pmin = corner == 0 ? point : glm::min(bbox.Pmin, point);
+                    bbox.Pmax = corner == 0 ? point : glm::max(bbox.Pmax, point);
+                }
+
+                objectInstances[i].worldToObject = sceneObjects[i]->getInverseModelMatrix();
+                objectInstances[i].blasNode = blas.rootNode;
+                objectInstances[i].quantizedBLASNode = blas.quantizedRootNode;
+            }
+        };
+        parallelFor(sceneObjects.size(), parallelObjectsThreshold, setUpInstances);
+
+        tlasNodes.clear();
+        instances.clear();
+        if (sceneObjects.empty())
+        {
+            tlasObjects.clear();
+            return;
+        }
+
+        // transform edits keep the same objects, so the TLAS is only refitted
+        // until its SAH cost grows too much. Spatial splits would duplicate instances and
+        // stop the refits, the SBVH mode only applies to the BLAS.
+        BVH_Build_Mode tlasBuildMode = buildMode == SBVH ? PARALLEL_SAH : buildMode;
+        if (sceneObjects == tlasObjects && tlasAccelerator.buildMode == tlasBuildMode)
+            tlasAccelerator.refitTree(bboxes);
+        else
+        {
+            tlasAccelerator.buildMode = tlasBuildMode;
+            tlasAccelerator.logBuilds = false;
+            tlasAccelerator.buildTree(bboxes, 1);
+            tlasObjects = sceneObjects;
+        }
+        tlasNodes = tlasAccelerator.getBVHTree();
+        instances.reserve(objectInstances.size());
+        for (auto &&instanceIndex : tlasAccelerator.getOrderedObjects())
+            instances.push_back(objectInstances[instanceIndex]);
+    }
+};
+#endif
@@ -0,0 +1,175 @@
+// 4 or 8 wide BVH collapsed from the binary BLAS and TLAS of BVH_SceneAccelerator. The child
+// bounds of a node are stored as structure of arrays, so one node visit tests every child box
+// in a single vectorized loop instead of visiting one binary node per box.
+
+#ifndef BVH_WIDE_TREE_H
+#define BVH_WIDE_TREE_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <bvh_accelerator.h>
+#include <bvh_scene_accelerator.h>
+
+template <int W>
+struct BVH_WideNode
+{
+    static_assert(W == 4 || W == 8, "wide BVH nodes have 4 or 8 children");
+
+    alignas(64) float minX[W];
+    float minY[W];
+    float minZ[W];
+    float maxX[W];
+    float maxY[W];
+    float maxZ[W];
+    // inner children: wide node index and count 0, leaves: first item and item count,
+    // unused slots: count -1
+    int child[W];
+    int count[W];
+
+    // Slab test of the ray against every child box at once, returns one bit per child hit before
+    // tMax and the entry distance of every child.
+    unsigned int intersect(const glm::vec3 &origin, const glm::vec3 &dirfrac, float tMax, float (&tEntry)[W]) const
+    {
+        alignas(64) int hit[W];
+        for (int i = 0; i < W; i++)
+        {
+            float t1 = (minX[i] - origin.x) * dirfrac.x;
+            float t2 = (maxX[i] - origin.x) * dirfrac.x;
+            float t3 = (minY[i] - origin.y) * dirfrac.y;
+            float t4 = (maxY[i] - origin.y) * dirfrac.y;
+            float t5 = (minZ[i] - origin.z) * dirfrac.z;
+            float t6 = (maxZ[i] - origin.z) * dirfrac.z;
+
+            float tmin = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), std::min(t5, t6));
+            float tmax = std::min(std::min(std::max(t1, t2), std::max(t3, t4)), std::max(t5, t6));
+            tEntry[i] = tmin;
+            hit[i] = (count[i] >= 0) & (tmax >= 0.0f) & (tmin <= tmax) & (tmin <= tMax);
+        }
+        unsigned int mask = 0;
+        for (int i = 0; i < W; i++)
+            mask |= hit[i] << i;
+        return mask;
+    }
+};
+static_assert(sizeof(BVH_WideNode<8>) == 256, "BVH_WideNode<8> must fill four cache lines");
+static_assert(sizeof(BVH_WideNode<4>) == 128, "BVH_WideNode<4> must fill two cache lines");
+
+template <int W>
+class BVH_WideTree
+{
+public:
+    // Collapses the TLAS, and the BLAS too when the bottom level changed
+    void update(const BVH_SceneAccelerator &accelerator, bool bottomLevelChanged)
+    {
+        const std::vector<BVH_Instance> &instances = accelerator.getInstances();
+        if (bottomLevelChanged)
+        {
+            blasNodes.clear();
+            blasRoots.clear();
+        }
+        instanceRoots.resize(instances.size());
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+            auto root = blasRoots.find(instances[i].blasNode);
+            if (root == blasRoots.end())
+                root = blasRoots.emplace(instances[i].blasNode, collapse(accelerator.getBLASNodes(), instances[i].blasNode, blasNodes)).first;
+            instanceRoots[i] = root->second;
+        }
+
+        tlasNodes.clear();
+        if (!accelerator.getTLASNodes().empty())
+            collapse(accelerator.getTLASNodes(), 0, tlasNodes);
+    }
+
+    // TLAS nodes, leaves index the instances, the root is node 0
+    const std::vector<BVH_WideNode<W>> &getTLASNodes() const
+    {
+        return tlasNodes;
+    }
+
+    // BLAS nodes of every mesh, leaves index the triangles
+    const std::vector<BVH_WideNode<W>> &getBLASNodes() const
+    {
+        return blasNodes;
+    }
+
+    // wide BLAS root of every instance, in instance order
+    const std::vector<int> &getInstanceRoots() const
+    {
+        return instanceRoots;
+    }
+
+private:
+    std::vector<BVH_WideNode<W>> tlasNodes;
+    std::vector<BVH_WideNode<W>> blasNodes;
+    std::map<int, int> blasRoots; // binary BLAS root to wide BLAS root
+    std::vector<int> instanceRoots;
+
+    static float getSurfaceArea(const BVH_LinearNode &node)
+    {
+        glm::vec3 d = node.Pmax - node.Pmin;
+        return 2.0f * (d.x * d.y + d.x * d.z + d.y * d.z);
+    }
+
+    // Appends the subtree of the binary node as wide nodes in depth first order and returns its
+    // root. The children are gathered by opening the inner child with the largest surface area
+    // until the node is full, as it is the most likely to be hit.
+    static int collapse(const std::vector<BVH_LinearNode> &nodes, int nodeIndex, std::vector<BVH_WideNode<W>> &wideNodes)
+    {
+        int wideIndex = wideNodes.size();
+        wideNodes.emplace_back();
+
+        int children[W];
+        int childCount = 0;
+        if (nodes[nodeIndex].objectCount > 0)
+            children[childCount++] = nodeIndex;
+        else
+        {
+            children[childCount++] = nodeIndex + 1;
+            children[childCount++] = nodes[nodeIndex].offset;
+        }
+        while (childCount < W)
+        {
+            int largest = -1;
+            for (int i = 0; i < childCount; i++)
+                if (nodes[children[i]].objectCount == 0 &&
+                    (largest < 0 || getSurfaceArea(nodes[children[i]]) > getSurfaceArea(nodes[children[largest]])))
+                    largest = i;
+            if (largest < 0)
+                break;
+            int opened = children[largest];
+            children[largest] = opened + 1;
+            children[childCount++] = nodes[opened].offset;
+        }
+
+        // the recursion grows wideNodes, so the node is only written through its index
+        for (int i = 0; i < W; i++)
+        {
+            int child = -1, count = -1;
+            glm::vec3 pMin(0.0f), pMax(0.0f);
+            if (i < childCount)
+            {
+                const BVH_LinearNode &node = nodes[children[i]];
+                pMin = node.Pmin;
+                pMax = node.Pmax;
+                count = node.objectCount;
+                child = count > 0 ? node.offset : collapse(nodes, children[i], wideNodes);
+            }
+            BVH_WideNode<W> &wideNode = wideNodes[wideIndex];
+            wideNode.minX[i] = pMin.x;
+            wideNode.minY[i] = pMin.y;
+            wideNode.minZ[i] = pMin.z;
+            wideNode.maxX[i] = pMax.x;
+            wideNode.maxY[i] = pMax.y;
+            wideNode.maxZ[i] = pMax.z;
+            wideNode.child[i] = child;
+            wideNode.count[i] = count;
+        }
+        return wideIndex;
+    }
+};
+#endif
@@ -23,20 +23,9 @@ public:
     {
         // 1. retrieve the vertex/fragment source code from filePath
         std::string computeCode;
-        std::ifstream computeShaderFile;
-        // ensure ifstream objects can throw exceptions:
-        computeShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
         try
         {
-            // open files
-            computeShaderFile.open(computePath);
-            std::stringstream computeShaderStream;
-            // read file's buffer contents into streams
-            computeShaderStream << computeShaderFile.rdbuf();
-            // close file handlers
-            computeShaderFile.close();
-            // convert stream into string
-            computeCode = computeShaderStream.str();
+            computeCode = readSource(computePath);
         }
         catch (std::ifstream::failure &e)
         {
@@ -97,6 +86,34 @@ public:
     }
 
 private:
+    // Source of the shader file with its #include "file" lines replaced by the files, found
+    // relative to the including file. GLSL has no includes, they share code such as the sampler
+    // with the CPU renderer.
+    static std::string readSource(const std::string &path, int depth = 0)
+    {
+        std::ifstream file;
+        // ensure ifstream objects can throw exceptions:
+        file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        file.open(path);
+        std::stringstream stream;
+        stream << file.rdbuf();
+        file.close();
+        if (depth > 8)
+            return stream.str();
+
+        std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+        std::string source, line;
+        while (std::getline(stream, line))
+        {
+            size_t first = line.find('"'), last = line.rfind('"');
+            if (line.compare(0, 8, "#include") == 0 && first != std::string::npos && last > first)
+                source += readSource(directory + line.substr(first + 1, last - first - 1), depth + 1);
+            else
+                source += line + "\n";
+        }
+        return source;
+    }
+
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
     void checkCompileErrors(unsigned int shader, std::string type)
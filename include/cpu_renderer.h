@@ -0,0 +1,1307 @@
+// CPU port of src/shaders/raytracing/raytracing.comp, used to render without a GL context.
+
+#ifndef CPU_RENDERER_H
+#define CPU_RENDERER_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+
+#include <camera.h>
+#include <object.h>
+#include <bvh_scene_accelerator.h>
+#include <bvh_wide_tree.h>
+#include <ray_packet.h>
+#include <tile_scheduler.h>
+#include <sample_budget.h>
+#include <sampler.h>
+#include <scene_light.h>
+
+class CPURenderer
+{
+public:
+    // view
+    int width, height;
+    unsigned int numThreads;
+
+    // render settings, same values as the compute shader
+    int maxBounces = 8;
+    float aperture = 0.030f;
+    BVH_Build_Mode bvhBuildMode = PARALLEL_SAH;
+    // primary rays are traced in packets of 4, 8 or 16 neighbouring pixels, 1 traces single rays
+    int packetSize = 8;
+    // single rays traverse the binary BVH (2) or a collapsed 4 or 8 wide BVH, packets always
+    // traverse the binary one. Takes effect on the next setUpGeometryData. The default matches
+    // the vector width, 8 wide nodes only pay off with AVX.
+#ifdef __AVX__
+    int bvhWidth = 8;
+#else
+    int bvhWidth = 4;
+#endif
+    // the binary traversal of single rays reads the quantized BLAS nodes, like the compute shader
+    // does when they are enabled. Only that traversal reads them, so it overrides bvhWidth and
+    // packetSize with 2 and 1. Takes effect on the next setUpGeometryData.
+    bool quantizedBVH = false;
+    // Traces the paths of a tile bounce by bounce instead of one path after the other: all rays of
+    // a bounce are traced, then shaded, and the survivors are sorted by direction octant and origin
+    // before the next bounce so consecutive rays visit the same nodes. packetSize is ignored. The
+    // queue holds every sample of the tile, larger tiles make longer queues.
+    bool wavefront = false;
+    // Next event estimation: every bounce samples a light and traces a shadow ray to it, weighted
+    // against the bounces that hit the lights. Off, the lights are only found by the bounces, as a
+    // baseline for the benchmark.
+    bool lightSampling = true;
+    // tile size and order of the render and the per tile progress callback
+    TileScheduler scheduler;
+    // frame time renderFrame fills and its measured cost
+    SampleBudget budget;
+    // Adaptive sampling: once every pixel has adaptiveMinSamples, only the tiles whose noise is
+    // above adaptiveThreshold get samples. The noise is the standard error of the pixel luminance
+    // in display units, the same estimate the compute shader uses.
+    bool adaptiveSampling = false;
+    float adaptiveThreshold = 0.005f;
+    unsigned int adaptiveMinSamples = 16;
+
+    // stats of the last render call
+    unsigned long long raysTraced = 0;
+    unsigned long long nodeVisits = 0;
+    double renderSeconds = 0.0;
+
+    // constructor
+    CPURenderer(int width, int height, unsigned int numThreads = std::thread::hardware_concurrency())
+    {
+        this->width = width;
+        this->height = height;
+        this->numThreads = numThreads > 0 ? numThreads : 1;
+        resetSampling();
+    }
+
+    // builds the BLAS of new meshes and the TLAS over the objects, a moved object only costs a TLAS build
+    void setUpGeometryData(std::vector<std::shared_ptr<Object>> &objects)
+    {
+        accelerator.buildMode = bvhBuildMode;
+        accelerator.quantizeBLAS = quantizedBVH;
+        int treeWidth = quantizedBVH ? 2 : bvhWidth;
+        bool bottomLevelChanged = accelerator.update(objects) || wideTreeWidth != treeWidth;
+        wideTreeWidth = treeWidth;
+        lights = SceneLight::collect(objects);
+        if (treeWidth == 4)
+            wideTree4.update(accelerator, bottomLevelChanged);
+        else if (treeWidth == 8)
+            wideTree8.update(accelerator, bottomLevelChanged);
+    }
+
+    void resize(int width, int height)
+    {
+        this->width = width;
+        this->height = height;
+        resetSampling();
+    }
+
+    void resetSampling()
+    {
+        currentSample = 0;
+        nextTile = 0;
+        passTiles.clear();
+        converged = false;
+        accumulation.assign(width * height, glm::vec3(0.0f));
+        compensation.assign(width * height, glm::vec3(0.0f));
+        luminanceSquares.assign(width * height, 0.0f);
+        sampleCounts.assign(width * height, 0);
+    }
+
+    // samples every pixel has, with adaptive sampling the tiles that converged skip the later ones
+    unsigned int getSamples()
+    {
+        return currentSample;
+    }
+
+    // traces `samples` more samples per pixel and adds them to the accumulation buffer, a sample
+    // left in progress by renderFrame is finished first. With adaptive sampling the samples after
+    // adaptiveMinSamples only go to the tiles above the noise threshold, and the render stops
+    // early once there are none.
+    void render(const Camera &camera, int samples = 1)
+    {
+        View view = getView(camera);
+        raysTraced = 0;
+        nodeVisits = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        if (nextTile > 0)
+        {
+            renderTiles(view, 1, std::vector<int>(passTiles.begin() + nextTile, passTiles.end()));
+            currentSample++;
+            nextTile = 0;
+        }
+        scheduler.setUp(width, height);
+        for (int done = 0; done < samples;)
+        {
+            startPass();
+            if (converged)
+                break;
+            // the tiles are checked before every sample once the minimum is reached
+            int passSamples = samples - done;
+            if (adaptiveSampling)
+                passSamples = currentSample < adaptiveMinSamples ? std::min<int>(passSamples, adaptiveMinSamples - currentSample) : 1;
+            renderTiles(view, passSamples, passTiles);
+            currentSample += passSamples;
+            done += passSamples;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        renderSeconds = std::chrono::duration<double>(end - start).count();
+    }
+
+    // Progressive render: traces as many samples as fit into budget.targetSeconds, or the next
+    // tiles of a sample when a whole one takes longer
+    void renderFrame(const Camera &camera)
+    {
+        View view = getView(camera);
+        // the tiles only change between samples
+        if (nextTile == 0)
+        {
+            scheduler.setUp(width, height);
+            startPass();
+        }
+        raysTraced = 0;
+        nodeVisits = 0;
+        renderSeconds = 0.0;
+        if (converged)
+            return;
+        const std::vector<RenderTile> &tiles = scheduler.getTiles();
+        unsigned long long passPixels = 0;
+        for (int tile : passTiles)
+            passPixels += (unsigned long long)(tiles[tile].x1 - tiles[tile].x0) * (tiles[tile].y1 - tiles[tile].y0);
+        unsigned long long plannedPixels = budget.plan(1);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        unsigned long long tracedPixels = 0;
+        if (nextTile == 0 && plannedPixels >= passPixels)
+        {
+            int samples = int(plannedPixels / passPixels);
+            renderTiles(view, samples, passTiles);
+            currentSample += samples;
+            tracedPixels = samples * passPixels;
+        }
+        else
+        {
+            int lastTile = nextTile;
+            while (lastTile < int(passTiles.size()) && tracedPixels < plannedPixels)
+            {
+                const RenderTile &tile = tiles[passTiles[lastTile++]];
+                tracedPixels += (unsigned long long)(tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+            }
+            renderTiles(view, 1, std::vector<int>(passTiles.begin() + nextTile, passTiles.begin() + lastTile));
+            nextTile = lastTile < int(passTiles.size()) ? lastTile : 0;
+            if (nextTile == 0)
+                currentSample++;
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        renderSeconds = std::chrono::duration<double>(end - start).count();
+        budget.record(tracedPixels, renderSeconds);
+    }
+
+    // adaptive sampling found no tile above the noise threshold, the render stopped
+    bool isConverged()
+    {
+        return converged;
+    }
+
+    // full frame samples per second renderFrame sustains
+    double getSamplesPerSecond()
+    {
+        return budget.getSamplesPerSecond((unsigned long long)width * height);
+    }
+
+    // average of the accumulated samples, gamma encoded like the display pass of the compute shader
+    std::vector<glm::vec3> getImage()
+    {
+        std::vector<glm::vec3> image(width * height, glm::vec3(0.0f));
+        for (size_t i = 0; i < image.size(); i++)
+        {
+            if (sampleCounts[i] == 0)
+                continue;
+            glm::vec3 color = accumulation[i] * (1.0f / sampleCounts[i]);
+            image[i] = glm::vec3(std::pow(color.x, 1.0f / GAMMA),
+                                 std::pow(color.y, 1.0f / GAMMA),
+                                 std::pow(color.z, 1.0f / GAMMA));
+        }
+        return image;
+    }
+
+    // writes a binary PPM, top row first
+    bool writeImage(const std::string &path)
+    {
+        std::ofstream file(path, std::ios::binary);
+        if (!file)
+        {
+            std::cout << "ERROR::CPU_RENDERER::Could not open " << path << std::endl;
+            return false;
+        }
+        std::vector<glm::vec3> image = getImage();
+        file << "P6\n"
+             << width << " " << height << "\n255\n";
+        std::vector<unsigned char> row(width * 3);
+        for (int y = height - 1; y >= 0; y--)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                glm::vec3 color = glm::clamp(image[y * width + x], 0.0f, 1.0f);
+                row[x * 3 + 0] = static_cast<unsigned char>(color.x * 255.0f + 0.5f);
+                row[x * 3 + 1] = static_cast<unsigned char>(color.y * 255.0f + 0.5f);
+                row[x * 3 + 2] = static_cast<unsigned char>(color.z * 255.0f + 0.5f);
+            }
+            file.write(reinterpret_cast<const char *>(row.data()), row.size());
+        }
+        return true;
+    }
+
+    void printStats()
+    {
+        std::cout << "CPU render " << width << "x" << height << ", " << currentSample << " samples, "
+                  << numThreads << " threads, " << scheduler.getTileCount() << " tiles (" << scheduler.tilesStolen << " stolen), "
+                  << (wavefront ? "wavefront" : std::to_string(!quantizedBVH && (packetSize == 4 || packetSize == 8 || packetSize == 16) ? packetSize : 1) + " rays per packet")
+                  << ", BVH" << (wideTreeWidth == 4 || wideTreeWidth == 8 ? wideTreeWidth : 2) << (quantizedBVH ? " quantized" : "") << ": " << renderSeconds << " s, "
+                  << raysTraced / renderSeconds / 1e6 << " Mrays/s, " << double(nodeVisits) / raysTraced << " node visits per ray" << std::endl;
+    }
+
+private:
+    static constexpr float MAX_DISTANCE = 999999.0f;
+    static constexpr float MIN_DISTANCE = 0.00001f;
+    static constexpr float GAMMA = 2.0f;
+
+    struct Ray
+    {
+        glm::vec3 origin;
+        glm::vec3 direction;
+    };
+
+    struct Hit
+    {
+        glm::vec3 position;
+        glm::vec3 normal;
+        float t;
+    };
+
+    // per thread counters, summed into the stats at the end of a render
+    struct TraceStats
+    {
+        unsigned long long rays = 0;
+        unsigned long long nodeVisits = 0;
+    };
+
+    struct View
+    {
+        glm::vec3 position, front, right, up;
+        float FOV, focusDist;
+    };
+
+    // geometry
+    BVH_SceneAccelerator accelerator = BVH_SceneAccelerator();
+    BVH_WideTree<4> wideTree4;
+    BVH_WideTree<8> wideTree8;
+    int wideTreeWidth = 0; // bvhWidth the wide tree was collapsed for
+    std::vector<SceneLight> lights;
+
+    // samples
+    unsigned int currentSample = 0;
+    std::vector<glm::vec3> accumulation; // linear sum of the samples
+    std::vector<glm::vec3> compensation; // of the Kahan summation of accumulation
+    std::vector<float> luminanceSquares;  // sum of the squared sample luminances
+    std::vector<unsigned int> sampleCounts; // per pixel, tiles of a sample in progress have one more
+    std::vector<int> passTiles;             // tiles of the sample in progress
+    int nextTile = 0;                       // first of passTiles not traced yet, 0 between samples
+    bool converged = false;
+
+    static float luminance(const glm::vec3 &color)
+    {
+        return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    }
+
+    // standard error of the mean luminance in display units, like the tile error pass of the shader
+    float getPixelError(int pixel)
+    {
+        float n = float(sampleCounts[pixel]);
+        if (n < 2.0f)
+            return 1.0f;
+        float mean = luminance(accumulation[pixel]) / n;
+        float variance = std::max(luminanceSquares[pixel] / n - mean * mean, 0.0f) * n / (n - 1.0f);
+        return std::sqrt(variance / n) / (2.0f * std::sqrt(std::max(mean, 1e-4f)));
+    }
+
+    // error of the worst pixel of the tile
+    float getTileError(const RenderTile &tile)
+    {
+        float error = 0.0f;
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+                error = std::max(error, getPixelError(y * width + x));
+        return error;
+    }
+
+    // tiles of the next sample, with adaptive sampling only the ones above the noise threshold
+    void startPass()
+    {
+        bool checkErrors = adaptiveSampling && currentSample >= adaptiveMinSamples;
+        passTiles.clear();
+        for (auto &&tile : scheduler.getTiles())
+            if (!checkErrors || getTileError(tile) > adaptiveThreshold)
+                passTiles.push_back(tile.index);
+        converged = checkErrors && passTiles.empty();
+    }
+
+    // Kahan summation, the sum keeps its precision past many thousand samples. squares is the sum of
+    // the squared luminances of the samples in color.
+    void accumulate(int pixel, const glm::vec3 &color, float squares)
+    {
+        luminanceSquares[pixel] += squares;
+        glm::vec3 y = color - compensation[pixel];
+        glm::vec3 t = accumulation[pixel] + y;
+        compensation[pixel] = (t - accumulation[pixel]) - y;
+        accumulation[pixel] = t;
+    }
+
+    View getView(const Camera &camera)
+    {
+        View view;
+        view.position = camera.WorldPosition;
+        view.front = camera.WorldFront;
+        view.right = camera.WorldRight;
+        view.up = camera.WorldUp;
+        view.FOV = glm::radians(camera.Zoom * 0.5f);
+        view.focusDist = glm::length(camera.WorldPosition);
+        return view;
+    }
+
+    // traces `samples` samples, starting at currentSample, for the listed tiles and adds their
+    // rays to the stats
+    void renderTiles(const View &view, int samples, const std::vector<int> &tileIndices)
+    {
+        unsigned int firstSample = currentSample;
+        std::vector<TraceStats> threadStats(numThreads);
+        scheduler.run(numThreads, [&](const RenderTile &tile, unsigned int thread)
+                      {
+                          // counted per tile, the per thread counters share cache lines
+                          TraceStats tileStats;
+                          switch (wavefront ? 0 : quantizedBVH ? 1 : packetSize)
+                          {
+                          case 0:
+                              renderWavefrontTile(view, samples, firstSample, tile, tileStats);
+                              break;
+                          case 4:
+                              renderPacketTile<4>(view, samples, firstSample, tile, tileStats);
+                              break;
+                          case 8:
+                              renderPacketTile<8>(view, samples, firstSample, tile, tileStats);
+                              break;
+                          case 16:
+                              renderPacketTile<16>(view, samples, firstSample, tile, tileStats);
+                              break;
+                          default:
+                              renderTile(view, samples, firstSample, tile, tileStats);
+                              break;
+                          }
+                          for (int y = tile.y0; y < tile.y1; y++)
+                              for (int x = tile.x0; x < tile.x1; x++)
+                                  sampleCounts[y * width + x] += samples;
+                          threadStats[thread].rays += tileStats.rays;
+                          threadStats[thread].nodeVisits += tileStats.nodeVisits; },
+                      tileIndices);
+
+        for (auto &&stats : threadStats)
+        {
+            raysTraced += stats.rays;
+            nodeVisits += stats.nodeVisits;
+        }
+    }
+
+    Hit rayTriangleIntersect(const Ray &ray, const Vertex &v1, const Vertex &v2, const Vertex &v3)
+    {
+        Hit hit;
+        glm::vec3 edge1 = v2.Position - v1.Position;
+        glm::vec3 edge2 = v3.Position - v1.Position;
+        // compute the plane's normal
+        glm::vec3 h = glm::cross(ray.direction, edge2);
+        float a = glm::dot(edge1, h);
+        if (a > -MIN_DISTANCE && a < MIN_DISTANCE)
+        {
+            hit.t = -1;
+            return hit;
+        }
+        float f = 1.0f / a;
+        glm::vec3 s = ray.origin - v1.Position;
+        float u = f * glm::dot(s, h);
+        if (u < 0.0f || u > 1.0f)
+        {
+            hit.t = -1;
+            return hit;
+        }
+        glm::vec3 q = glm::cross(s, edge1);
+        float v = f * glm::dot(ray.direction, q);
+        if (v < 0.0f || u + v > 1.0f)
+        {
+            hit.t = -1;
+            return hit;
+        }
+        hit.t = f * glm::dot(edge2, q);
+        if (hit.t > MIN_DISTANCE)
+        {
+            hit.position = ray.origin + ray.direction * hit.t;
+            hit.normal = (1 - u - v) * v1.Normal + u * v2.Normal + v * v3.Normal; // interpolate normals
+        }
+        return hit;
+    }
+
+    glm::vec3 getBackgroundColor(const Ray &ray)
+    {
+        float t = 0.5f * (ray.direction.y + 1.0f);
+        return (1.0f - t) * glm::vec3(1.0f, 1.0f, 1.0f) + t * glm::vec3(0.5f, 0.7f, 1.0f);
+    }
+
+    // entry distance of the ray into the box, -1 when it misses the box or enters it beyond maxT
+    float rayBoxEntry(const glm::vec3 &origin, const glm::vec3 &dirfrac, const glm::vec3 &pMin, const glm::vec3 &pMax, float maxT)
+    {
+        float t1 = (pMin.x - origin.x) * dirfrac.x;
+        float t2 = (pMax.x - origin.x) * dirfrac.x;
+        float t3 = (pMin.y - origin.y) * dirfrac.y;
+        float t4 = (pMax.y - origin.y) * dirfrac.y;
+        float t5 = (pMin.z - origin.z) * dirfrac.z;
+        float t6 = (pMax.z - origin.z) * dirfrac.z;
+
+        float tmin = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), std::min(t5, t6));
+        float tmax = std::min(std::min(std::max(t1, t2), std::max(t3, t4)), std::max(t5, t6));
+
+        return (tmax >= 0 && tmin <= tmax && tmin <= maxT) ? std::max(tmin, 0.0f) : -1.0f;
+    }
+
+    bool rayBoxIntersect(const glm::vec3 &origin, const glm::vec3 &dirfrac, const glm::vec3 &pMin, const glm::vec3 &pMax, float maxT)
+    {
+        return rayBoxEntry(origin, dirfrac, pMin, pMax, maxT) >= 0.0f;
+    }
+
+    // Closest hit in the BLAS rooted at rootNode, the ray is in object space. Only hits closer than
+    // closestT are returned and the nodes entered beyond the closest hit so far are skipped, the
+    // near child first along the split axis so it shrinks early. anyHit returns the first hit
+    // found instead, for the occlusion queries.
+    Hit traverseBLAS(const Ray &ray, int rootNode, float closestT, bool anyHit, TraceStats &stats)
+    {
+        const std::vector<BVH_LinearNode> &nodes = accelerator.getBLASNodes();
+        const std::vector<Vertex> &vertices = accelerator.getVertices();
+        const std::vector<unsigned int> &indices = accelerator.getTriangleIndices();
+        Hit closestHit;
+        closestHit.t = closestT;
+        glm::vec3 dirfrac = 1.0f / ray.direction;
+        bool dirIsNeg[3] = {ray.direction.x < 0.0f, ray.direction.y < 0.0f, ray.direction.z < 0.0f};
+        // Follow ray through BVH nodes to find primitive intersections
+        int toVisitOffset = 0;
+        int currentNodeIndex = rootNode;
+        int nodesToVisit[64];
+        while (true)
+        {
+            const BVH_LinearNode &node = nodes[currentNodeIndex];
+            stats.nodeVisits++;
+            // Check ray against BVH node
+            if (rayBoxIntersect(ray.origin, dirfrac, node.Pmin, node.Pmax, closestHit.t))
+            {
+                if (node.objectCount > 0)
+                {
+                    // Intersect ray with primitives in leaf BVH node
+                    for (int i = node.offset; i < node.offset + node.objectCount; i++)
+                    {
+                        Hit hit = rayTriangleIntersect(ray, vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]);
+                        if (hit.t > MIN_DISTANCE && hit.t < closestHit.t)
+                        {
+                            closestHit = hit;
+                            if (anyHit)
+                                return closestHit;
+                        }
+                    }
+                    if (toVisitOffset == 0)
+                        break;
+                    currentNodeIndex = nodesToVisit[--toVisitOffset];
+                    continue;
+                }
+                // Put the far child on nodesToVisit stack, advance to the near one. The first child
+                // holds the lower side of the split.
+                if (dirIsNeg[node.splitAxis])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.offset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node.offset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                continue;
+            }
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+        return closestHit;
+    }
+
+    // Quantized version of traverseBLAS. A node holds the boxes of its children, decoded in the
+    // node box, so the children are tested before being visited and stacked with their box. Both
+    // entry distances are known, the nearer child is visited first.
+    Hit traverseQuantizedBLAS(const Ray &ray, int headerNode, float closestT, bool anyHit, TraceStats &stats)
+    {
+        const std::vector<BVH_QuantizedNode> &nodes = accelerator.getQuantizedBLASNodes();
+        const std::vector<Vertex> &vertices = accelerator.getVertices();
+        const std::vector<unsigned int> &indices = accelerator.getTriangleIndices();
+        Hit closestHit;
+        closestHit.t = closestT;
+        glm::vec3 dirfrac = 1.0f / ray.direction;
+
+        struct QuantizedStackEntry
+        {
+            int node;
+            bool leaf;
+            glm::vec3 pMin, pMax;
+        };
+        QuantizedStackEntry current;
+        current.node = headerNode + BVH_QuantizedNode::headerNodes;
+        BVH_QuantizedNode::decodeHeader(&nodes[headerNode], current.pMin, current.pMax, current.leaf);
+        if (!rayBoxIntersect(ray.origin, dirfrac, current.pMin, current.pMax, closestHit.t))
+            return closestHit;
+
+        int toVisitOffset = 0;
+        QuantizedStackEntry nodesToVisit[64];
+        while (true)
+        {
+            const BVH_QuantizedNode &node = nodes[current.node];
+            stats.nodeVisits++;
+            if (current.leaf)
+            {
+                for (int i = node.getIndex(); i < int(node.getIndex() + node.getObjectCount()); i++)
+                {
+                    Hit hit = rayTriangleIntersect(ray, vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]);
+                    if (hit.t > MIN_DISTANCE && hit.t < closestHit.t)
+                    {
+                        closestHit = hit;
+                        if (anyHit)
+                            return closestHit;
+                    }
+                }
+            }
+            else
+            {
+                QuantizedStackEntry children[2];
+                float childEntry[2];
+                for (int child = 0; child < 2; child++)
+                {
+                    children[child].node = child == 0 ? current.node + 1 : node.getIndex();
+                    children[child].leaf = node.isLeafChild(child);
+                    node.decodeChild(child, current.pMin, current.pMax, children[child].pMin, children[child].pMax);
+                    childEntry[child] = rayBoxEntry(ray.origin, dirfrac, children[child].pMin, children[child].pMax, closestHit.t);
+                }
+                int nearChild = childEntry[1] >= 0.0f && (childEntry[0] < 0.0f || childEntry[1] < childEntry[0]) ? 1 : 0;
+                if (childEntry[0] >= 0.0f && childEntry[1] >= 0.0f)
+                    nodesToVisit[toVisitOffset++] = children[1 - nearChild];
+                if (childEntry[nearChild] >= 0.0f)
+                {
+                    current = children[nearChild];
+                    continue;
+                }
+            }
+            if (toVisitOffset == 0)
+                break;
+            current = nodesToVisit[--toVisitOffset];
+        }
+        return closestHit;
+    }
+
+    // Walks the TLAS in world space, every instance reached traverses its BLAS with the ray
+    // in object space. The object space direction is not normalized, so t is the same in both.
+    // Like the BLAS, near children come first and only hits closer than maxT count, anyHit
+    // returns the first one.
+    Hit traverseBVH(const Ray &ray, float maxT, bool anyHit, TraceStats &stats)
+    {
+        const std::vector<BVH_LinearNode> &nodes = accelerator.getTLASNodes();
+        const std::vector<BVH_Instance> &instances = accelerator.getInstances();
+        Hit closestHit;
+        closestHit.t = maxT;
+        if (nodes.empty())
+        {
+            closestHit.t = -1.0f;
+            return closestHit;
+        }
+        glm::vec3 dirfrac = 1.0f / ray.direction;
+        bool dirIsNeg[3] = {ray.direction.x < 0.0f, ray.direction.y < 0.0f, ray.direction.z < 0.0f};
+        int toVisitOffset = 0;
+        int currentNodeIndex = 0;
+        int nodesToVisit[64];
+        while (true)
+        {
+            const BVH_LinearNode &node = nodes[currentNodeIndex];
+            stats.nodeVisits++;
+            if (rayBoxIntersect(ray.origin, dirfrac, node.Pmin, node.Pmax, closestHit.t))
+            {
+                if (node.objectCount > 0)
+                {
+                    for (int i = node.offset; i < node.offset + node.objectCount; i++)
+                    {
+                        const BVH_Instance &instance = instances[i];
+                        Ray objectRay;
+                        objectRay.origin = instance.worldToObject * glm::vec4(ray.origin, 1.0f);
+                        objectRay.direction = glm::mat3(instance.worldToObject) * ray.direction;
+                        Hit hit = accelerator.getQuantizedBLASNodes().empty() ? traverseBLAS(objectRay, instance.blasNode, closestHit.t, anyHit, stats)
+                                                                              : traverseQuantizedBLAS(objectRay, instance.quantizedBLASNode, closestHit.t, anyHit, stats);
+                        if (hit.t > MIN_DISTANCE && hit.t < closestHit.t)
+                        {
+                            closestHit.t = hit.t;
+                            if (anyHit)
+                                return closestHit;
+                            closestHit.position = ray.origin + ray.direction * hit.t;
+                            closestHit.normal = glm::normalize(glm::transpose(glm::mat3(instance.worldToObject)) * hit.normal);
+                        }
+                    }
+                    if (toVisitOffset == 0)
+                        break;
+                    currentNodeIndex = nodesToVisit[--toVisitOffset];
+                    continue;
+                }
+                if (dirIsNeg[node.splitAxis])
+                {
+                    nodesToVisit[toVisitOffset++] = currentNodeIndex + 1;
+                    currentNodeIndex = node.offset;
+                }
+                else
+                {
+                    nodesToVisit[toVisitOffset++] = node.offset;
+                    currentNodeIndex = currentNodeIndex + 1;
+                }
+                continue;
+            }
+            if (toVisitOffset == 0)
+                break;
+            currentNodeIndex = nodesToVisit[--toVisitOffset];
+        }
+        if (closestHit.t == maxT)
+            closestHit.t = -1.0f;
+        return closestHit;
+    }
+
+    // closest hit of a single ray, over the BVH selected by bvhWidth
+    Hit traceRay(const Ray &ray, TraceStats &stats)
+    {
+        if (wideTreeWidth == 4)
+            return traverseWideBVH(ray, wideTree4, MAX_DISTANCE, false, stats);
+        if (wideTreeWidth == 8)
+            return traverseWideBVH(ray, wideTree8, MAX_DISTANCE, false, stats);
+        return traverseBVH(ray, MAX_DISTANCE, false, stats);
+    }
+
+    // Occlusion query of a shadow ray, true when anything is hit closer than maxT. The
+    // traversal stops at the first hit, which does not need to be the closest one.
+    bool traceOcclusion(const Ray &ray, float maxT, TraceStats &stats)
+    {
+        if (wideTreeWidth == 4)
+            return traverseWideBVH(ray, wideTree4, maxT, true, stats).t > 0.0f;
+        if (wideTreeWidth == 8)
+            return traverseWideBVH(ray, wideTree8, maxT, true, stats).t > 0.0f;
+        return traverseBVH(ray, maxT, true, stats).t > 0.0f;
+    }
+
+    // Entry of the wide traversal stacks, nodes entered beyond the closest hit found since they
+    // were pushed are skipped
+    struct WideStackEntry
+    {
+        int node;
+        float tEntry;
+    };
+
+    // Visits a wide node: calls visitLeaf(first, count) for the leaves hit and pushes the inner
+    // children hit, farthest first so the nearest one is visited next
+    template <int W, typename F>
+    void visitWideNode(const BVH_WideNode<W> &node, const Ray &ray, const glm::vec3 &dirfrac, const float &closestT,
+                       WideStackEntry *nodesToVisit, int &toVisitOffset, F visitLeaf)
+    {
+        alignas(64) float tEntry[W];
+        unsigned int mask = node.intersect(ray.origin, dirfrac, closestT, tEntry);
+        int innerChildren[W];
+        int innerCount = 0;
+        for (int i = 0; i < W; i++)
+        {
+            if (((mask >> i) & 1u) == 0)
+                continue;
+            if (node.count[i] > 0)
+                visitLeaf(node.child[i], node.count[i]);
+            else
+                innerChildren[innerCount++] = i;
+        }
+        // insertion sort, at most 8 children
+        for (int i = 1; i < innerCount; i++)
+            for (int j = i; j > 0 && tEntry[innerChildren[j]] > tEntry[innerChildren[j - 1]]; j--)
+                std::swap(innerChildren[j], innerChildren[j - 1]);
+        for (int i = 0; i < innerCount; i++)
+            if (tEntry[innerChildren[i]] <= closestT)
+                nodesToVisit[toVisitOffset++] = WideStackEntry{node.child[innerChildren[i]], tEntry[innerChildren[i]]};
+    }
+
+    // wide version of traverseBLAS
+    template <int W>
+    Hit traverseWideBLAS(const Ray &ray, int rootNode, const BVH_WideTree<W> &tree, float closestT, bool anyHit, TraceStats &stats)
+    {
+        const std::vector<BVH_WideNode<W>> &nodes = tree.getBLASNodes();
+        const std::vector<Vertex> &vertices = accelerator.getVertices();
+        const std::vector<unsigned int> &indices = accelerator.getTriangleIndices();
+        Hit closestHit;
+        closestHit.t = closestT;
+        glm::vec3 dirfrac = 1.0f / ray.direction;
+        bool found = false;
+        auto intersectTriangles = [&](int first, int count)
+        {
+            for (int i = first; i < first + count && !found; i++)
+            {
+                Hit hit = rayTriangleIntersect(ray, vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]);
+                if (hit.t > MIN_DISTANCE && hit.t < closestHit.t)
+                {
+                    closestHit = hit;
+                    found = anyHit;
+                }
+            }
+        };
+
+        // every visit pushes at most W - 1 more nodes than it pops
+        WideStackEntry nodesToVisit[64 * (W - 1)];
+        int toVisitOffset = 0;
+        nodesToVisit[toVisitOffset++] = WideStackEntry{rootNode, 0.0f};
+        while (toVisitOffset > 0 && !found)
+        {
+            WideStackEntry entry = nodesToVisit[--toVisitOffset];
+            if (entry.tEntry > closestHit.t)
+                continue;
+            stats.nodeVisits++;
+            visitWideNode(nodes[entry.node], ray, dirfrac, closestHit.t, nodesToVisit, toVisitOffset, intersectTriangles);
+        }
+        return closestHit;
+    }
+
+    // wide version of traverseBVH
+    template <int W>
+    Hit traverseWideBVH(const Ray &ray, const BVH_WideTree<W> &tree, float maxT, bool anyHit, TraceStats &stats)
+    {
+        const std::vector<BVH_WideNode<W>> &nodes = tree.getTLASNodes();
+        const std::vector<BVH_Instance> &instances = accelerator.getInstances();
+        const std::vector<int> &instanceRoots = tree.getInstanceRoots();
+        Hit closestHit;
+        closestHit.t = maxT;
+        if (nodes.empty())
+        {
+            closestHit.t = -1.0f;
+            return closestHit;
+        }
+        glm::vec3 dirfrac = 1.0f / ray.direction;
+        bool found = false;
+        auto intersectInstances = [&](int first, int count)
+        {
+            for (int i = first; i < first + count && !found; i++)
+            {
+                const BVH_Instance &instance = instances[i];
+                Ray objectRay;
+                objectRay.origin = instance.worldToObject * glm::vec4(ray.origin, 1.0f);
+                objectRay.direction = glm::mat3(instance.worldToObject) * ray.direction;
+                Hit hit = traverseWideBLAS(objectRay, instanceRoots[i], tree, closestHit.t, anyHit, stats);
+                if (hit.t < closestHit.t)
+                {
+                    closestHit.t = hit.t;
+                    found = anyHit;
+                    closestHit.position = ray.origin + ray.direction * hit.t;
+                    closestHit.normal = glm::normalize(glm::transpose(glm::mat3(instance.worldToObject)) * hit.normal);
+                }
+            }
+        };
+
+        WideStackEntry nodesToVisit[64 * (W - 1)];
+        int toVisitOffset = 0;
+        nodesToVisit[toVisitOffset++] = WideStackEntry{0, 0.0f};
+        while (toVisitOffset > 0 && !found)
+        {
+            WideStackEntry entry = nodesToVisit[--toVisitOffset];
+            if (entry.tEntry > closestHit.t)
+                continue;
+            stats.nodeVisits++;
+            visitWideNode(nodes[entry.node], ray, dirfrac, closestHit.t, nodesToVisit, toVisitOffset, intersectInstances);
+        }
+        if (closestHit.t == maxT)
+            closestHit.t = -1.0f;
+        return closestHit;
+    }
+
+    // every pixel of the tile traced one ray at a time
+    void renderTile(const View &view, int samples, unsigned int firstSample, const RenderTile &tile, TraceStats &stats)
+    {
+        for (int y = tile.y0; y < tile.y1; y++)
+        {
+            for (int x = tile.x0; x < tile.x1; x++)
+            {
+                glm::vec3 color(0.0f);
+                float squares = 0.0f;
+                for (int s = 0; s < samples; s++)
+                {
+                    PathSampler sampler(x, y, firstSample + s + 1);
+                    glm::vec2 coord = glm::vec2(x, y) + sampler.next2D();
+                    Ray ray = getTexelRay(coord, view, sampler);
+                    glm::vec3 sampleColor = getRayColor(ray, sampler, stats);
+                    color += sampleColor;
+                    squares += luminance(sampleColor) * luminance(sampleColor);
+                }
+                accumulate(y * width + x, color, squares);
+            }
+        }
+    }
+
+    // path of the wavefront mode between two bounces
+    struct PathState
+    {
+        Ray ray;
+        glm::vec3 throughput;
+        glm::vec3 radiance;
+        float bsdfPdf;
+        unsigned int path; // pixel in the tile times samples plus sample
+        PathSampler sampler;
+    };
+
+    // Generate, extend and shade stages over the queue of all paths of the tile. Every path keeps
+    // its own RNG and the colors are summed in sample order at the end, so the image is the same
+    // as the one of renderTile.
+    void renderWavefrontTile(const View &view, int samples, unsigned int firstSample, const RenderTile &tile, TraceStats &stats)
+    {
+        int tileWidth = tile.x1 - tile.x0;
+        size_t pathCount = size_t(tileWidth) * (tile.y1 - tile.y0) * samples;
+        std::vector<glm::vec3> colors(pathCount, glm::vec3(maxBounces > 0 ? 0.0f : 1.0f));
+
+        // generate, in pixel order, which is coherent enough for the primary rays
+        std::vector<PathState> paths, sortedPaths;
+        paths.reserve(pathCount);
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+                for (int s = 0; s < samples; s++)
+                {
+                    PathSampler sampler(x, y, firstSample + s + 1);
+                    glm::vec2 coord = glm::vec2(x, y) + sampler.next2D();
+                    Ray ray = getTexelRay(coord, view, sampler);
+                    unsigned int path = ((y - tile.y0) * tileWidth + x - tile.x0) * samples + s;
+                    paths.push_back(PathState{ray, glm::vec3(1.0f), glm::vec3(0.0f), 0.0f, path, sampler});
+                }
+
+        std::vector<Hit> hits;
+        std::vector<uint64_t> keys;
+        for (int bounce = 0; bounce < maxBounces && !paths.empty(); bounce++)
+        {
+            if (bounce > 0)
+                sortPaths(paths, sortedPaths, keys);
+
+            // extend
+            hits.resize(paths.size());
+            for (size_t i = 0; i < paths.size(); i++)
+                hits[i] = traceRay(paths[i].ray, stats);
+            stats.rays += paths.size();
+
+            // shade, the paths that go on are compacted to the front of the queue
+            size_t alive = 0;
+            for (size_t i = 0; i < paths.size(); i++)
+            {
+                PathState path = paths[i];
+                if (!shadePath(path.ray, hits[i], path.throughput, path.radiance, path.bsdfPdf, path.sampler, stats))
+                    colors[path.path] = path.radiance;
+                else if (bounce + 1 == maxBounces)
+                    colors[path.path] = path.radiance + path.throughput;
+                else
+                    paths[alive++] = path;
+            }
+            paths.erase(paths.begin() + alive, paths.end());
+        }
+
+        for (int y = tile.y0; y < tile.y1; y++)
+            for (int x = tile.x0; x < tile.x1; x++)
+            {
+                const glm::vec3 *pixelColors = &colors[size_t((y - tile.y0) * tileWidth + x - tile.x0) * samples];
+                glm::vec3 color(0.0f);
+                float squares = 0.0f;
+                for (int s = 0; s < samples; s++)
+                {
+                    color += pixelColors[s];
+                    squares += luminance(pixelColors[s]) * luminance(pixelColors[s]);
+                }
+                accumulate(y * width + x, color, squares);
+            }
+    }
+
+    // Sorts the paths by the octant of their direction, then by the Morton code of their origin in
+    // the scene bounds, 9 bits per axis. The key and the queue position share one word.
+    void sortPaths(std::vector<PathState> &paths, std::vector<PathState> &sortedPaths, std::vector<uint64_t> &keys)
+    {
+        const std::vector<BVH_LinearNode> &tlasNodes = accelerator.getTLASNodes();
+        if (tlasNodes.empty())
+            return;
+        glm::vec3 sceneMin = tlasNodes[0].Pmin;
+        glm::vec3 extent = tlasNodes[0].Pmax - tlasNodes[0].Pmin;
+        glm::vec3 scale(extent.x > 0.0f ? 511.0f / extent.x : 0.0f, extent.y > 0.0f ? 511.0f / extent.y : 0.0f,
+                        extent.z > 0.0f ? 511.0f / extent.z : 0.0f);
+
+        keys.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++)
+        {
+            const Ray &ray = paths[i].ray;
+            uint64_t octant = (ray.direction.x < 0.0f ? 1u : 0u) | (ray.direction.y < 0.0f ? 2u : 0u) | (ray.direction.z < 0.0f ? 4u : 0u);
+            glm::vec3 cell = glm::clamp((ray.origin - sceneMin) * scale, 0.0f, 511.0f);
+            uint64_t morton = 0;
+            unsigned int cellX = unsigned(cell.x), cellY = unsigned(cell.y), cellZ = unsigned(cell.z);
+            for (int bit = 0; bit < 9; bit++)
+                morton |= uint64_t(((cellX >> bit) & 1u) | (((cellY >> bit) & 1u) << 1) | (((cellZ >> bit) & 1u) << 2)) << (3 * bit);
+            keys[i] = (((octant << 27) | morton) << 32) | uint64_t(i);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        sortedPaths.clear();
+        sortedPaths.reserve(paths.size());
+        for (uint64_t key : keys)
+            sortedPaths.push_back(paths[uint32_t(key)]);
+        paths.swap(sortedPaths);
+    }
+
+    // Pixel blocks of the tile, 2x2 for 4 rays and 4 wide for 8 and 16. The primary rays of a block
+    // are coherent and traced as one packet, the diffuse bounces diverge and go on as single rays.
+    template <int N>
+    void renderPacketTile(const View &view, int samples, unsigned int firstSample, const RenderTile &tile, TraceStats &stats)
+    {
+        constexpr int blockWidth = N == 4 ? 2 : 4;
+        constexpr int blockHeight = N / blockWidth;
+        RayPacket<N> packet;
+        PacketHit<N> packetHit;
+        std::vector<PathSampler> samplers;
+        samplers.reserve(N);
+        Ray laneRays[N];
+        glm::vec3 colors[N];
+        float squares[N];
+
+        for (int blockY = tile.y0; blockY < tile.y1; blockY += blockHeight)
+        {
+            for (int blockX = tile.x0; blockX < tile.x1; blockX += blockWidth)
+            {
+                std::fill(colors, colors + N, glm::vec3(0.0f));
+                std::fill(squares, squares + N, 0.0f);
+                for (int s = 0; s < samples; s++)
+                {
+                    // lanes past the tile border repeat its last pixel and are not stored
+                    samplers.clear();
+                    for (int lane = 0; lane < N; lane++)
+                    {
+                        int x = std::min(blockX + lane % blockWidth, tile.x1 - 1);
+                        int y = std::min(blockY + lane / blockWidth, tile.y1 - 1);
+                        samplers.emplace_back(x, y, firstSample + s + 1);
+                        glm::vec2 coord = glm::vec2(x, y) + samplers[lane].next2D();
+                        laneRays[lane] = getTexelRay(coord, view, samplers[lane]);
+                        packet.setRay(lane, laneRays[lane].origin, laneRays[lane].direction, MAX_DISTANCE);
+                    }
+                    packet.updateBounds();
+                    traversePacket(packet, packetHit, stats);
+
+                    for (int lane = 0; lane < N; lane++)
+                    {
+                        if (blockX + lane % blockWidth >= tile.x1 || blockY + lane / blockWidth >= tile.y1)
+                            continue;
+                        stats.rays++;
+                        glm::vec3 sampleColor = getHitColor(laneRays[lane], getPacketHit(packet, packetHit, lane), samplers[lane], stats);
+                        colors[lane] += sampleColor;
+                        squares[lane] += luminance(sampleColor) * luminance(sampleColor);
+                    }
+                }
+                for (int lane = 0; lane < N; lane++)
+                {
+                    int x = blockX + lane % blockWidth, y = blockY + lane / blockWidth;
+                    if (x < tile.x1 && y < tile.y1)
+                        accumulate(y * width + x, colors[lane], squares[lane]);
+                }
+            }
+        }
+    }
+
+    // packet version of traverseBLAS, only the lanes of laneMask are traced
+    template <int N>
+    void traversePacketBLAS(RayPacket<N> &packet, PacketHit<N> &packetHit, int rootNode, unsigned int laneMask, TraceStats &stats)
+    {
+        const std::vector<BVH_LinearNode> &nodes = accelerator.getBLASNodes();
+        const std::vector<Vertex> &vertices = accelerator.getVertices();
+        const std::vector<unsigned int> &indices = accelerator.getTriangleIndices();
+        // every stacked node keeps the lanes that hit its parent
+        int toVisitOffset = 0;
+        int currentNodeIndex = rootNode;
+        unsigned int currentMask = laneMask;
+        int nodesToVisit[64];
+        unsigned int masksToVisit[64];
+        while (true)
+        {
+            const BVH_LinearNode &node = nodes[currentNodeIndex];
+            stats.nodeVisits++;
+            unsigned int mask = packet.missesBox(node.Pmin, node.Pmax) ? 0u : packet.intersectBox(node.Pmin, node.Pmax, currentMask);
+            if (mask != 0)
+            {
+                if (node.objectCount > 0)
+                {
+                    alignas(64) int lanes[N];
+                    unpackLaneMask(mask, lanes);
+                    for (int i = node.offset; i < node.offset + node.objectCount; i++)
+                        intersectTriangle(packet, packetHit, lanes, i, vertices[indices[3 * i]].Position,
+                                          vertices[indices[3 * i + 1]].Position, vertices[indices[3 * i + 2]].Position, MIN_DISTANCE);
+                    if (toVisitOffset == 0)
+                        break;
+                    --toVisitOffset;
+                    currentNodeIndex = nodesToVisit[toVisitOffset];
+                    currentMask = masksToVisit[toVisitOffset];
+                    continue;
+                }
+                nodesToVisit[toVisitOffset] = node.offset;
+                masksToVisit[toVisitOffset++] = mask;
+                currentNodeIndex = currentNodeIndex + 1;
+                currentMask = mask;
+                continue;
+            }
+            if (toVisitOffset == 0)
+                break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset];
+            currentMask = masksToVisit[toVisitOffset];
+        }
+    }
+
+    // packet version of traverseBVH, every instance reached traces the packet in object space
+    template <int N>
+    void traversePacket(RayPacket<N> &packet, PacketHit<N> &packetHit, TraceStats &stats)
+    {
+        const std::vector<BVH_LinearNode> &nodes = accelerator.getTLASNodes();
+        const std::vector<BVH_Instance> &instances = accelerator.getInstances();
+        std::fill(packetHit.triangle, packetHit.triangle + N, -1);
+        if (nodes.empty())
+            return;
+        int toVisitOffset = 0;
+        int currentNodeIndex = 0;
+        unsigned int currentMask = (1u << N) - 1u;
+        int nodesToVisit[64];
+        unsigned int masksToVisit[64];
+        while (true)
+        {
+            const BVH_LinearNode &node = nodes[currentNodeIndex];
+            stats.nodeVisits++;
+            unsigned int mask = packet.missesBox(node.Pmin, node.Pmax) ? 0u : packet.intersectBox(node.Pmin, node.Pmax, currentMask);
+            if (mask != 0)
+            {
+                if (node.objectCount > 0)
+                {
+                    for (int i = node.offset; i < node.offset + node.objectCount; i++)
+                    {
+                        RayPacket<N> objectPacket = packet.transformed(instances[i].worldToObject);
+                        traversePacketBLAS(objectPacket, packetHit, instances[i].blasNode, mask, stats);
+                        for (int lane = 0; lane < N; lane++)
+                        {
+                            bool closer = objectPacket.tMax[lane] < packet.tMax[lane];
+                            packet.tMax[lane] = closer ? objectPacket.tMax[lane] : packet.tMax[lane];
+                            packetHit.instance[lane] = closer ? i : packetHit.instance[lane];
+                        }
+                    }
+                    if (toVisitOffset == 0)
+                        break;
+                    --toVisitOffset;
+                    currentNodeIndex = nodesToVisit[toVisitOffset];
+                    currentMask = masksToVisit[toVisitOffset];
+                    continue;
+                }
+                nodesToVisit[toVisitOffset] = node.offset;
+                masksToVisit[toVisitOffset++] = mask;
+                currentNodeIndex = currentNodeIndex + 1;
+                currentMask = mask;
+                continue;
+            }
+            if (toVisitOffset == 0)
+                break;
+            --toVisitOffset;
+            currentNodeIndex = nodesToVisit[toVisitOffset];
+            currentMask = masksToVisit[toVisitOffset];
+        }
+    }
+
+    // closest hit of one lane, in world space like the ones of traverseBVH
+    template <int N>
+    Hit getPacketHit(const RayPacket<N> &packet, const PacketHit<N> &packetHit, int lane)
+    {
+        Hit hit;
+        hit.t = -1.0f;
+        if (packetHit.triangle[lane] < 0)
+            return hit;
+        const std::vector<Vertex> &vertices = accelerator.getVertices();
+        const std::vector<unsigned int> &indices = accelerator.getTriangleIndices();
+        const BVH_Instance &instance = accelerator.getInstances()[packetHit.instance[lane]];
+        int triangle = packetHit.triangle[lane];
+
+        // normal interpolated in object space with the barycentrics of the packet test
+        float u = packetHit.u[lane], v = packetHit.v[lane];
+        glm::vec3 objectNormal = (1 - u - v) * vertices[indices[3 * triangle]].Normal + u * vertices[indices[3 * triangle + 1]].Normal +
+                                 v * vertices[indices[3 * triangle + 2]].Normal;
+
+        glm::vec3 origin(packet.origin[0][lane], packet.origin[1][lane], packet.origin[2][lane]);
+        glm::vec3 direction(packet.direction[0][lane], packet.direction[1][lane], packet.direction[2][lane]);
+        hit.t = packet.tMax[lane];
+        hit.position = origin + direction * hit.t;
+        hit.normal = glm::normalize(glm::transpose(glm::mat3(instance.worldToObject)) * objectNormal);
+        return hit;
+    }
+
+    glm::vec3 getRayColor(Ray ray, PathSampler &sampler, TraceStats &stats)
+    {
+        Hit hit = traceRay(ray, stats);
+        stats.rays++;
+        return getHitColor(ray, hit, sampler, stats);
+    }
+
+    // color of a ray whose first hit is known, the bounces trace single rays
+    glm::vec3 getHitColor(Ray ray, Hit hit, PathSampler &sampler, TraceStats &stats)
+    {
+        glm::vec3 throughput(1.0f), radiance(0.0f);
+        float bsdfPdf = 0.0f;
+
+        for (int bounce = 0; bounce < maxBounces; bounce++)
+        {
+            if (bounce > 0)
+            {
+                hit = traceRay(ray, stats);
+                stats.rays++;
+            }
+            if (!shadePath(ray, hit, throughput, radiance, bsdfPdf, sampler, stats))
+                return radiance;
+        }
+        // the paths cut by the bounce limit keep their throughput, like the compute shader
+        return radiance + throughput;
+    }
+
+    // One bounce of a path at the closest hit of its ray. Adds the light or the background the ray
+    // reaches, or the light sampled at the surface, and turns the ray into the cosine sampled
+    // bounce. bsdfPdf is the solid angle pdf of the ray, 0 for camera rays. Returns false when the
+    // path ended.
+    bool shadePath(Ray &ray, const Hit &hit, glm::vec3 &throughput, glm::vec3 &radiance, float &bsdfPdf, PathSampler &sampler, TraceStats &stats)
+    {
+        float lightT = hit.t < MIN_DISTANCE ? MAX_DISTANCE : hit.t;
+        int light = getLightHit(ray, lightT);
+        if (light >= 0)
+        {
+            // weighted against the light sampling at the ray origin, which could draw the same ray
+            float sin2ThetaMax = getLightSin2ThetaMax(ray.origin, light);
+            float weight = lightSampling && bsdfPdf > 0.0f && sin2ThetaMax < 1.0f
+                               ? sampler_glsl::samplerPowerHeuristic(bsdfPdf, sampler_glsl::samplerUniformConePdf(sin2ThetaMax) / lights.size())
+                               : 1.0f;
+            radiance += throughput * weight * glm::vec3(lights[light].emission);
+            return false;
+        }
+        if (hit.t < MIN_DISTANCE)
+        {
+            radiance += throughput * getBackgroundColor(ray);
+            return false;
+        }
+
+        if (lightSampling && !lights.empty())
+            radiance += throughput * sampleLight(hit, sampler, stats);
+        ray.origin = hit.position;
+        ray.direction = glm::normalize(sampler.nextCosineDirection(hit.normal));
+        bsdfPdf = std::max(glm::dot(hit.normal, ray.direction), 0.0f) / SAMPLER_PI;
+        throughput *= 0.5f;
+        return true;
+    }
+
+    // nearest light the ray hits before maxT, -1 when there is none. maxT becomes its distance.
+    int getLightHit(const Ray &ray, float &maxT)
+    {
+        int nearest = -1;
+        for (size_t i = 0; i < lights.size(); i++)
+        {
+            glm::vec3 oc = ray.origin - glm::vec3(lights[i].positionRadius);
+            float radius = lights[i].positionRadius.w;
+            float halfB = glm::dot(oc, ray.direction);
+            float discriminant = halfB * halfB - (glm::dot(oc, oc) - radius * radius);
+            if (discriminant < 0.0f)
+                continue;
+            float t = -halfB - std::sqrt(discriminant);
+            if (t > MIN_DISTANCE && t < maxT)
+            {
+                maxT = t;
+                nearest = int(i);
+            }
+        }
+        return nearest;
+    }
+
+    // squared sine of the half angle of the cone the light covers from the point, 1 inside it
+    float getLightSin2ThetaMax(const glm::vec3 &point, int light)
+    {
+        glm::vec3 toLight = glm::vec3(lights[light].positionRadius) - point;
+        float radius = lights[light].positionRadius.w;
+        return std::min(radius * radius / glm::dot(toLight, toLight), 1.0f);
+    }
+
+    // Next event estimation: one light picked uniformly, a direction in its cone and a shadow ray.
+    // Returns the reflected radiance weighted against the cosine sampling of the bounce.
+    glm::vec3 sampleLight(const Hit &hit, PathSampler &sampler, TraceStats &stats)
+    {
+        glm::vec2 u = sampler.next2D();
+        int lightCount = int(lights.size());
+        int light = std::min(int(u.x * lightCount), lightCount - 1);
+        u.x = u.x * lightCount - light; // the rest of the dimension stays uniform
+        float sin2ThetaMax = getLightSin2ThetaMax(hit.position, light);
+        if (sin2ThetaMax >= 1.0f)
+            return glm::vec3(0.0f);
+        glm::vec3 axis = glm::normalize(glm::vec3(lights[light].positionRadius) - hit.position);
+        Ray shadowRay;
+        shadowRay.origin = hit.position;
+        shadowRay.direction = glm::normalize(sampler_glsl::samplerUniformCone(axis, sin2ThetaMax, u));
+        float cosine = glm::dot(hit.normal, shadowRay.direction);
+        if (cosine <= 0.0f)
+            return glm::vec3(0.0f);
+
+        // the sampled light has to be the first thing the shadow ray hits
+        float lightT = MAX_DISTANCE;
+        if (getLightHit(shadowRay, lightT) != light)
+            return glm::vec3(0.0f);
+        bool occluded = traceOcclusion(shadowRay, lightT, stats);
+        stats.rays++;
+        if (occluded)
+            return glm::vec3(0.0f);
+
+        float lightPdf = sampler_glsl::samplerUniformConePdf(sin2ThetaMax) / lightCount;
+        float bsdfPdf = cosine / SAMPLER_PI;
+        // diffuse BSDF of albedo 0.5
+        return glm::vec3(lights[light].emission) * (0.5f / SAMPLER_PI * cosine / lightPdf * sampler_glsl::samplerPowerHeuristic(lightPdf, bsdfPdf));
+    }
+
+    Ray getTexelRay(glm::vec2 texelCoord, const View &view, PathSampler &sampler)
+    {
+        float x = texelCoord.x / width * 2 - 1;
+        float y = texelCoord.y / height * 2 - 1;
+
+        float aspectRatio = float(width) / height;
+
+        glm::vec2 randomDisk = aperture * 0.5f * sampler.nextDisk();
+        glm::vec3 offset = view.right * randomDisk.x + view.up * randomDisk.y;
+
+        glm::vec3 frontal = view.front * view.focusDist;
+        glm::vec3 vertical = view.up * std::tan(view.FOV) * view.focusDist;
+        glm::vec3 horizontal = view.right * std::tan(view.FOV) * aspectRatio * view.focusDist;
+
+        glm::vec3 P = view.position + frontal + horizontal * x + vertical * y;
+
+        Ray ray;
+        ray.origin = view.position + offset;
+        ray.direction = glm::normalize(P - view.position - offset);
+        return ray;
+    }
+};
+#endif
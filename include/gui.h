@@ -113,7 +113,10 @@ public:
                 float position[3] = {object->location.x, object->location.y, object->location.z};
                 bool positionChange = ImGui::DragFloat3("Position", position, 0.01f, -1000.0f, 1000.0f);
                 if (positionChange)
+                {
                     object->location = glm::vec3(position[0], position[1], position[2]);
+                    scene->updateGeometry();
+                }
                 ImGui::Text("Rotation (%.3f, %.3f, %.3f)",
                             object->rotation.x, object->rotation.y, object->rotation.z);
                 ImGui::Text("Scale (%.3f, %.3f, %.3f)",
@@ -121,7 +124,14 @@ public:
                 float color[3] = {object->color.x, object->color.y, object->color.z};
                 bool colorChange = ImGui::ColorEdit3("Color", color);
                 if (colorChange)
+                {
                     object->color = glm::vec3(color[0], color[1], color[2]);
+                    // the path tracers only read the color of the lights
+                    if (object->meshType == LIGHT)
+                        scene->updateGeometry();
+                }
+                if (object->meshType == LIGHT && ImGui::DragFloat("Strength", &object->lightStrength, 0.5f, 0.0f, 10000.0f))
+                    scene->updateGeometry();
             }
             ImGui::SeparatorText("##emptyCubeAdd");
             if (ImGui::Button("Add cube"))
@@ -131,12 +141,41 @@ public:
                 cube->translate(randomVec);
                 scene->addObject(cube);
             }
+            ImGui::SameLine();
+            if (ImGui::Button("Add light"))
+            {
+                std::shared_ptr<Object> light = std::make_shared<Object>(std::string("Light"), LIGHT);
+                glm::vec3 randomVec = glm::linearRand(glm::vec3(-5.0f), glm::vec3(5.0f));
+                light->translate(randomVec);
+                scene->addObject(light);
+                scene->updateGeometry();
+            }
             ImGui::SeparatorText("Render");
-            ImGui::Text("Samples %i",
-                        scene->getSamples());
+            ImGui::Text("Samples %i (%.1f samples/s)",
+                        scene->getSamples(), scene->getSamplesPerSecond());
+            float frameBudgetMs = float(scene->renderBudget.targetSeconds * 1000.0);
+            if (ImGui::SliderFloat("Frame budget (ms)", &frameBudgetMs, 4.0f, 100.0f, "%.0f"))
+                scene->renderBudget.targetSeconds = frameBudgetMs / 1000.0;
+            if (scene->isConverged())
+                ImGui::Text("Converged");
+            else if (scene->adaptiveSampling && scene->getActiveTiles() >= 0)
+                ImGui::Text("Active tiles %i / %i", scene->getActiveTiles(), scene->getTileCount());
+            bool adaptiveChange = ImGui::Checkbox("Adaptive sampling", &scene->adaptiveSampling);
+            adaptiveChange |= ImGui::SliderFloat("Noise threshold", &scene->adaptiveThreshold, 0.001f, 0.05f, "%.3f");
+            if (adaptiveChange)
+                scene->updateAdaptiveSampling();
             bool updateGeo = ImGui::SliderInt("Triangles", &scene->numTriangles, 1, 1000);
             if (updateGeo)
                 scene->resetSampling();
+            const char *bvhBuilders[] = {"SAH", "Parallel SAH", "LBVH", "HLBVH", "SBVH"};
+            int bvhBuilder = scene->bvhBuildMode;
+            if (ImGui::Combo("BVH builder", &bvhBuilder, bvhBuilders, IM_ARRAYSIZE(bvhBuilders)))
+            {
+                scene->bvhBuildMode = static_cast<BVH_Build_Mode>(bvhBuilder);
+                scene->updateGeometry();
+            }
+            if (ImGui::Checkbox("Quantized BVH", &scene->quantizedBVH))
+                scene->updateGeometry();
             ImGui::End();
         }
         ImGui::End();
@@ -246,6 +246,7 @@ public:
             {
                 object->location = initialState[object->name] + translation;
             }
+            scene->updateGeometry();
         }
 
         if (action == SCALE)
@@ -297,6 +298,7 @@ public:
             {
                 object->scale = initialState[object->name] * scale;
             }
+            scene->updateGeometry();
         }
 
         if (action == ROTATE)
@@ -357,6 +359,7 @@ public:
             {
                 object->rotation = initialState[object->name] + rotation;
             }
+            scene->updateGeometry();
         }
     };
 
@@ -407,6 +410,7 @@ private:
                 break;
             }
         }
+        scene->updateGeometry();
     }
 
     void confirmAction()
@@ -0,0 +1,88 @@
+// Read-only view of a whole file. POSIX systems map it, so the pages are only read from disk (or
+// the page cache) when they are touched, other systems read it into memory.
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPPED_FILE_MMAP
+#endif
+
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string &path)
+    {
+#ifdef MAPPED_FILE_MMAP
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) == 0 && fileStat.st_size > 0)
+        {
+            void *mapping = mmap(nullptr, fileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED)
+            {
+                bytes = static_cast<const char *>(mapping);
+                length = fileStat.st_size;
+            }
+        }
+        close(fd);
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+            return;
+        buffer.resize(size_t(file.tellg()));
+        file.seekg(0);
+        if (!buffer.empty() && file.read(buffer.data(), buffer.size()))
+        {
+            bytes = buffer.data();
+            length = buffer.size();
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+#ifdef MAPPED_FILE_MMAP
+        if (bytes != nullptr)
+            munmap(const_cast<char *>(bytes), length);
+#endif
+    }
+
+    // false when the file could not be opened or is empty
+    bool isOpen() const
+    {
+        return bytes != nullptr;
+    }
+
+    const char *data() const
+    {
+        return bytes;
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+#ifndef MAPPED_FILE_MMAP
+    std::vector<char> buffer;
+#endif
+};
+#endif
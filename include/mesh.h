@@ -9,6 +9,10 @@
 #include <shader.h>
 #include <string>
 #include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <cstdint>
 
 struct Vertex
 {
@@ -62,24 +66,66 @@ struct BoundingBox
     }
 };
 
+// Read-only array of mesh data. It either owns its values or views memory kept alive by its
+// owner, such as a mapped mesh file, so loaded meshes are used in place. Copies share the values.
+template <typename T>
+class MeshArray
+{
+public:
+    MeshArray() = default;
+
+    MeshArray(std::vector<T> values)
+    {
+        std::shared_ptr<std::vector<T>> ownedValues = std::make_shared<std::vector<T>>(std::move(values));
+        elements = ownedValues->data();
+        count = ownedValues->size();
+        owner = ownedValues;
+    }
+
+    MeshArray(const T *elements, size_t count, std::shared_ptr<const void> owner)
+        : elements(elements), count(count), owner(std::move(owner)) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T *data() const { return elements; }
+    const T *begin() const { return elements; }
+    const T *end() const { return elements + count; }
+    const T &operator[](size_t i) const { return elements[i]; }
+
+private:
+    const T *elements = nullptr;
+    size_t count = 0;
+    std::shared_ptr<const void> owner;
+};
+
 class Mesh
 {
 public:
     // mesh Data
-    std::vector<Vertex> vertices;
-    std::vector<unsigned int> indices;
-    std::vector<Triangle> triangles;
-    unsigned int VAO;
+    MeshArray<Vertex> vertices;
+    MeshArray<unsigned int> indices; // three per triangle
+    unsigned int VAO = 0;
+    // content hash of the source asset, keys the BVH cache. 0 for meshes built in memory
+    uint64_t contentHash = 0;
 
     // constructor
-    Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices)
+    Mesh(MeshArray<Vertex> vertices, MeshArray<unsigned int> indices)
     {
-        this->vertices = vertices;
-        this->indices = indices;
+        this->vertices = std::move(vertices);
+        this->indices = std::move(indices);
 
-        // now that we have all the required data, set the vertex buffers and its attribute pointers.
-        setUpMesh();
-        createTriangles();
+        // vertex buffers are set up on the first draw, so meshes can also be built without a GL context.
+    }
+
+    size_t getTriangleCount() const
+    {
+        return indices.size() / 3;
+    }
+
+    // triangles are read through the indices, vertices shared by several triangles are stored once
+    Triangle getTriangle(size_t i) const
+    {
+        return Triangle{vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]]};
     }
 
     // render the mesh
@@ -111,6 +157,10 @@ public:
         //     glBindTexture(GL_TEXTURE_2D, textures[i].id);
         // }
 
+        // now that we have a GL context, set the vertex buffers and its attribute pointers.
+        if (VAO == 0)
+            setUpMesh();
+
         // draw mesh
         glBindVertexArray(VAO);
         glDrawElements(drawMode, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
@@ -138,10 +188,10 @@ private:
         // A great thing about structs is that their memory layout is sequential for all its items.
         // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
         // again translates to 3/2 floats which translates to a byte array.
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
 
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
 
         // set the vertex attribute pointers
         // vertex Positions
@@ -168,12 +218,78 @@ private:
         // glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, m_Weights));
         // glBindVertexArray(0);
     }
-    void createTriangles()
+};
+
+// Meshes shared by key (built-in shape name or model path). Every object using the same asset
+// references one Mesh, so its vertices, GPU buffers and BLAS are stored once. Entries are weak,
+// a mesh is freed with the last object using it.
+class MeshRegistry
+{
+public:
+    // returns the mesh registered under key, or registers the one returned by createMesh.
+    // Failed loads (nullptr) are not registered.
+    template <typename CreateMesh>
+    static std::shared_ptr<Mesh> getMesh(const std::string &key, CreateMesh createMesh)
     {
-        for (int i = 0; i < indices.size(); i += 3)
         {
-            triangles.push_back(Triangle{vertices[indices[i]], vertices[indices[i + 1]], vertices[indices[i + 2]]});
-        };
+            std::lock_guard<std::mutex> lock(getMutex());
+            std::shared_ptr<Mesh> mesh = findMesh(key);
+            if (mesh != nullptr)
+                return mesh;
+        }
+
+        // meshes are created unlocked, loading a model can take a while
+        std::shared_ptr<Mesh> newMesh = createMesh();
+        if (newMesh == nullptr)
+            return newMesh;
+
+        std::lock_guard<std::mutex> lock(getMutex());
+        std::shared_ptr<Mesh> mesh = findMesh(key);
+        if (mesh != nullptr)
+            return mesh;
+        // registrations are rare, sweeping the meshes no object uses anymore keeps the map to
+        // the live ones
+        std::map<std::string, std::weak_ptr<Mesh>> &meshes = getMeshes();
+        for (auto it = meshes.begin(); it != meshes.end();)
+            it = it->second.expired() ? meshes.erase(it) : ++it;
+        meshes[key] = newMesh;
+        return newMesh;
+    }
+
+    // number of meshes still in use
+    static int size()
+    {
+        std::lock_guard<std::mutex> lock(getMutex());
+        int count = 0;
+        for (auto &&entry : getMeshes())
+            count += entry.second.expired() ? 0 : 1;
+        return count;
+    }
+
+private:
+    static std::map<std::string, std::weak_ptr<Mesh>> &getMeshes()
+    {
+        static std::map<std::string, std::weak_ptr<Mesh>> meshes;
+        return meshes;
+    }
+
+    // live mesh of key, its entry is dropped once expired. The mutex has to be held.
+    static std::shared_ptr<Mesh> findMesh(const std::string &key)
+    {
+        std::map<std::string, std::weak_ptr<Mesh>> &meshes = getMeshes();
+        auto it = meshes.find(key);
+        if (it == meshes.end())
+            return nullptr;
+        std::shared_ptr<Mesh> mesh = it->second.lock();
+        if (mesh == nullptr)
+            meshes.erase(it);
+        return mesh;
+    }
+
+    static std::mutex &getMutex()
+    {
+        static std::mutex mutex;
+        return mutex;
     }
 };
 #endif
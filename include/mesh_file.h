@@ -0,0 +1,135 @@
+// Native binary mesh format (.rtmesh), written by raytracer_convert. The vertex stream has the
+// layout of Vertex and the index buffer holds three indices per triangle, so a loaded file is
+// mapped and used in place by the Mesh and uploaded to the GL buffers as is, without parsing.
+// Files are stored in the byte order of the machine that wrote them.
+
+#ifndef MESH_FILE_H
+#define MESH_FILE_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+
+#include <mesh.h>
+#include <mapped_file.h>
+
+// File layout: header, vertex stream at vertexOffset, index buffer at indexOffset. The offsets
+// are multiples of MeshFile::alignment.
+struct MeshFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t vertexSize; // sizeof(Vertex) of the writer
+    uint64_t vertexCount;
+    uint64_t indexCount;
+    uint64_t vertexOffset;
+    uint64_t indexOffset;
+    uint8_t pad[16];
+};
+static_assert(sizeof(MeshFileHeader) == 64, "MeshFileHeader must fill a cache line");
+
+class MeshFile
+{
+public:
+    static constexpr uint32_t version = 1;
+    static constexpr uint64_t alignment = 64;
+
+    static bool isMeshFile(const std::string &path)
+    {
+        const std::string extension = ".rtmesh";
+        return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    // Maps the file, the mesh arrays point into the mapping and keep it alive. Returns nullptr
+    // when the file cannot be read or is not a valid mesh file.
+    static std::shared_ptr<Mesh> load(const std::string &path)
+    {
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+        if (!file->isOpen() || file->size() < sizeof(MeshFileHeader))
+        {
+            std::cout << "ERROR::MESH_FILE::Could not read " << path << std::endl;
+            return nullptr;
+        }
+        const MeshFileHeader *header = reinterpret_cast<const MeshFileHeader *>(file->data());
+        if (std::memcmp(header->magic, fileMagic, sizeof(fileMagic)) != 0 || header->version != version ||
+            header->vertexSize != sizeof(Vertex) || header->indexCount % 3 != 0 ||
+            header->vertexOffset % alignment != 0 || header->indexOffset % alignment != 0 ||
+            header->vertexOffset + header->vertexCount * sizeof(Vertex) > file->size() ||
+            header->indexOffset + header->indexCount * sizeof(unsigned int) > file->size())
+        {
+            std::cout << "ERROR::MESH_FILE::Invalid mesh file " << path << std::endl;
+            return nullptr;
+        }
+
+        const Vertex *vertices = reinterpret_cast<const Vertex *>(file->data() + header->vertexOffset);
+        const unsigned int *indices = reinterpret_cast<const unsigned int *>(file->data() + header->indexOffset);
+        // a single pass over the indices, the renderers trust them
+        unsigned int maxIndex = 0;
+        for (uint64_t i = 0; i < header->indexCount; i++)
+            maxIndex = std::max(maxIndex, indices[i]);
+        if (header->indexCount > 0 && maxIndex >= header->vertexCount)
+        {
+            std::cout << "ERROR::MESH_FILE::Index out of range in " << path << std::endl;
+            return nullptr;
+        }
+        return std::make_shared<Mesh>(MeshArray<Vertex>(vertices, header->vertexCount, file),
+                                      MeshArray<unsigned int>(indices, header->indexCount, file));
+    }
+
+    // Writes the mesh under a temporary name and renames it, so a mapped older version of the
+    // file stays valid. Returns false on failure.
+    static bool write(const std::string &path, const Mesh &mesh)
+    {
+        MeshFileHeader header = {};
+        std::memcpy(header.magic, fileMagic, sizeof(header.magic));
+        header.version = version;
+        header.vertexSize = sizeof(Vertex);
+        header.vertexCount = mesh.vertices.size();
+        header.indexCount = mesh.indices.size();
+        header.vertexOffset = alignUp(sizeof(MeshFileHeader));
+        header.indexOffset = alignUp(header.vertexOffset + header.vertexCount * sizeof(Vertex));
+
+        std::string temporaryPath = path + ".tmp";
+        {
+            std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+            std::vector<char> padding(alignment, 0);
+            file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+            file.write(padding.data(), header.vertexOffset - sizeof(header));
+            file.write(reinterpret_cast<const char *>(mesh.vertices.data()), header.vertexCount * sizeof(Vertex));
+            file.write(padding.data(), header.indexOffset - header.vertexOffset - header.vertexCount * sizeof(Vertex));
+            file.write(reinterpret_cast<const char *>(mesh.indices.data()), header.indexCount * sizeof(unsigned int));
+            if (!file)
+            {
+                std::cout << "ERROR::MESH_FILE::Could not write " << temporaryPath << std::endl;
+                file.close();
+                std::remove(temporaryPath.c_str());
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporaryPath, path, error);
+        if (error)
+        {
+            std::cout << "ERROR::MESH_FILE::Could not write " << path << std::endl;
+            std::remove(temporaryPath.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr char fileMagic[8] = {'R', 'T', 'M', 'E', 'S', 'H', 0, 0};
+
+    static uint64_t alignUp(uint64_t offset)
+    {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+};
+#endif
@@ -11,9 +11,16 @@
 #include <assimp/postprocess.h>
 
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include <shader.h>
 #include <mesh.h>
+#include <bvh_cache.h>
+#include <mesh_file.h>
 
 enum Draw_Mode
 {
@@ -48,6 +55,8 @@ public:
     // draw
     Draw_Mode drawMode;
     glm::vec3 color = glm::vec3(1.0f);
+    // LIGHT objects render as spheres of half their largest scale emitting color * lightStrength
+    float lightStrength = 100.0f;
 
     // constructor
     Object(std::string name, Mesh_Type meshType, std::string path = "")
@@ -59,17 +68,22 @@ public:
         {
         case MESH:
             drawMode = SOLID;
-            generateCubeMesh();
+            mesh = MeshRegistry::getMesh("Cube", [this]()
+                                         { return generateCubeMesh(); });
             break;
         case LIGHT:
             drawMode = WIREFRAME;
             scale = glm::vec3(0.2f);
             color = glm::vec3(1.0f, 0.6f, 0.0f);
-            generateTriangleMesh();
+            mesh = MeshRegistry::getMesh("Light", [this]()
+                                         { return generateTriangleMesh(); });
             break;
         case IMPORTED:
             drawMode = SOLID;
-            loadModel(path);
+            // a model path is only parsed once, later objects share its mesh
+            mesh = MeshRegistry::getMesh(path, [this, path]()
+                                         { loadModel(path);
+                                           return mesh; });
             break;
         default:
             break;
@@ -98,86 +112,45 @@ public:
         location += globalTranslation;
     }
 
-    // returns the view matrix calculated using Euler Angles and the LookAt Matrix
+    // returns the model matrix calculated using Euler Angles, recomputed only when the transform changed
     glm::mat4 getModelMatrix()
     {
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::translate(model, location);
-        model = glm::rotate(model, glm::radians(rotation.x), glm::vec3(1.0f, 0.0f, 0.0f));
-        model = glm::rotate(model, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
-        model = glm::rotate(model, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
-        model = glm::scale(model, scale);
-        return model;
+        updateMatrices();
+        return modelMatrix;
     }
 
-    std::vector<Triangle> getModelTriangles()
+    glm::mat4 getInverseModelMatrix()
     {
-        std::vector<Triangle> modelTriangles = {};
-        glm::mat4 model = getModelMatrix();
-        Triangle tri;
-        for (auto &&triangle : mesh->triangles)
-        {
-            tri.P1.Position = model * glm::vec4(triangle.P1.Position, 1.0);
-            tri.P1.Normal = glm::normalize(glm::vec3(glm::mat4(glm::transpose(glm::inverse(model))) * glm::vec4(triangle.P1.Normal, 1.0)));
-            tri.P1.TexCoords = triangle.P1.TexCoords;
-            tri.P2.Position = model * glm::vec4(triangle.P2.Position, 1.0);
-            tri.P2.Normal = glm::normalize(glm::vec3(glm::mat4(glm::transpose(glm::inverse(model))) * glm::vec4(triangle.P2.Normal, 1.0)));
-            tri.P2.TexCoords = triangle.P2.TexCoords;
-            tri.P3.Position = model * glm::vec4(triangle.P3.Position, 1.0);
-            tri.P3.Normal = glm::normalize(glm::vec3(glm::mat4(glm::transpose(glm::inverse(model))) * glm::vec4(triangle.P3.Normal, 1.0)));
-            tri.P3.TexCoords = triangle.P3.TexCoords;
-            modelTriangles.push_back(tri);
-        }
-        return modelTriangles;
+        updateMatrices();
+        return inverseModelMatrix;
     }
 
-    std::shared_ptr<BoundingBox> getBoundingBox()
-    {
-        glm::mat4 model = getModelMatrix();
-        glm::vec3 vertexPosition = model * glm::vec4(mesh->vertices[0].Position, 1.0);
-        glm::vec3 minPoint = glm::vec4(vertexPosition, 1.0);
-        glm::vec3 maxPoint = glm::vec4(vertexPosition, 1.0);
-        for (size_t i = 1; i < mesh->vertices.size(); i++)
-        {
-            glm::vec3 vertexPosition = model * glm::vec4(mesh->vertices[i].Position, 1.0);
-            minPoint = glm::min(minPoint, vertexPosition);
-            maxPoint = glm::max(maxPoint, vertexPosition);
-        }
-        boundingBox->Pmax = maxPoint;
-        boundingBox->Pmin = minPoint;
-        return boundingBox;
-    }
+private:
+    // cached matrices and the transform they were computed from, compared on every access
+    // so direct writes to location, rotation and scale still mark them dirty
+    bool matricesValid = false;
+    glm::vec3 matricesLocation, matricesRotation, matricesScale;
+    glm::mat4 modelMatrix, inverseModelMatrix;
 
-    std::vector<std::shared_ptr<BoundingBox>> getTrianglesBoundingBoxes()
+    void updateMatrices()
     {
-        if (triangleBoundingBoxes.size() > 0)
-        {
-            triangleBoundingBoxes.clear();
-        }
-        std::vector<Triangle> triangles = getModelTriangles();
-        glm::vec3 minPoint;
-        glm::vec3 maxPoint;
-        for (auto &&tri : triangles)
-        {
-            minPoint = tri.P1.Position;
-            maxPoint = tri.P1.Position;
-            minPoint = glm::min(minPoint, tri.P2.Position);
-            maxPoint = glm::max(maxPoint, tri.P2.Position);
-            minPoint = glm::min(minPoint, tri.P3.Position);
-            maxPoint = glm::max(maxPoint, tri.P3.Position);
-            std::shared_ptr<BoundingBox> triBoundingBox = std::make_shared<BoundingBox>();
-            triBoundingBox->Pmax = maxPoint;
-            triBoundingBox->Pmin = minPoint;
-            triangleBoundingBoxes.push_back(triBoundingBox);
-        }
-        return triangleBoundingBoxes;
+        if (matricesValid && location == matricesLocation && rotation == matricesRotation && scale == matricesScale)
+            return;
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, location);
+        model = glm::rotate(model, glm::radians(rotation.x), glm::vec3(1.0f, 0.0f, 0.0f));
+        model = glm::rotate(model, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
+        model = glm::rotate(model, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
+        model = glm::scale(model, scale);
+        modelMatrix = model;
+        inverseModelMatrix = glm::inverse(model);
+        matricesLocation = location;
+        matricesRotation = rotation;
+        matricesScale = scale;
+        matricesValid = true;
     }
 
-private:
-    std::shared_ptr<BoundingBox> boundingBox = std::make_shared<BoundingBox>();
-    std::vector<std::shared_ptr<BoundingBox>> triangleBoundingBoxes = {};
-
-    void generateCubeMesh()
+    std::shared_ptr<Mesh> generateCubeMesh()
     {
         std::vector<Vertex> vertices = {
             // positions          // normals           // texture coords
@@ -224,9 +197,9 @@ private:
             i += 4;
         }
 
-        mesh = std::make_shared<Mesh>(vertices, indices);
+        return std::make_shared<Mesh>(vertices, indices);
     }
-    void generateTriangleMesh()
+    std::shared_ptr<Mesh> generateTriangleMesh()
     {
         std::vector<Vertex> vertices = {
             // positions        // normals      // texture coords
@@ -236,79 +209,178 @@ private:
         };
         std::vector<unsigned int> indices = {0, 1, 1, 2, 2, 0};
 
-        mesh = std::make_shared<Mesh>(vertices, indices);
+        return std::make_shared<Mesh>(vertices, indices);
     }
 
     void loadModel(std::string path)
     {
+        uint64_t contentHash = BVH_Cache::isEnabled() ? BVH_Cache::hashFile(path) : 0;
+
+        // native mesh files are mapped and used as they are
+        if (MeshFile::isMeshFile(path))
+        {
+            mesh = MeshFile::load(path);
+            if (mesh != nullptr)
+                mesh->contentHash = contentHash;
+            return;
+        }
+
+        // a cached copy of the same file content skips the import
+        if (contentHash != 0)
+        {
+            mesh = BVH_Cache::loadMesh(contentHash);
+            if (mesh != nullptr)
+            {
+                std::cout << "Model loaded from the BVH cache: " << path << std::endl;
+                return;
+            }
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
         Assimp::Importer import;
-        const aiScene *scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs);
+        const aiScene *scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices |
+                                                         aiProcess_GenSmoothNormals);
 
         if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
         {
             std::cout << "ERROR::ASSIMP::" << import.GetErrorString() << std::endl;
             return;
         }
-        processNode(scene->mRootNode, scene);
+
+        // every submesh placed by the node hierarchy goes into one mesh
+        std::vector<Submesh> submeshes;
+        processNode(scene->mRootNode, scene, glm::mat4(1.0f), submeshes);
+        mesh = mergeSubmeshes(submeshes);
+        if (mesh == nullptr)
+        {
+            std::cout << "ERROR::OBJECT::No triangles in " << path << std::endl;
+            return;
+        }
+        mesh->contentHash = contentHash;
+        std::cout << "Model imported: " << submeshes.size() << " submeshes, " << mesh->vertices.size() << " vertices, "
+                  << mesh->getTriangleCount() << " triangles in "
+                  << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
     }
 
-    void processNode(aiNode *node, const aiScene *scene)
+    // submesh of an imported model, placed by the transform of its node
+    struct Submesh
     {
+        const aiMesh *aimesh;
+        glm::mat4 transform;
+        size_t triangleCount = 0;
+        size_t vertexBase = 0, indexBase = 0;
+    };
+
+    // imports convert their submeshes on one thread per this many vertices
+    static constexpr size_t importVerticesPerThread = 1 << 16;
+
+    static void processNode(const aiNode *node, const aiScene *scene, const glm::mat4 &parentTransform, std::vector<Submesh> &submeshes)
+    {
+        // assimp matrices are row major
+        const aiMatrix4x4 &m = node->mTransformation;
+        glm::mat4 transform = parentTransform * glm::mat4(m.a1, m.b1, m.c1, m.d1, m.a2, m.b2, m.c2, m.d2,
+                                                          m.a3, m.b3, m.c3, m.d3, m.a4, m.b4, m.c4, m.d4);
         // process all the node's meshes (if any)
         for (unsigned int i = 0; i < node->mNumMeshes; i++)
-        {
-            aiMesh *aimesh = scene->mMeshes[node->mMeshes[i]];
-            processMesh(aimesh, scene);
-        }
+            submeshes.push_back(Submesh{scene->mMeshes[node->mMeshes[i]], transform});
         // then do the same for each of its children
         for (unsigned int i = 0; i < node->mNumChildren; i++)
+            processNode(node->mChildren[i], scene, transform, submeshes);
+    }
+
+    // runs f(i) for every submesh i, spread over threads when the model is big enough
+    template <typename F>
+    static void forEachSubmesh(size_t count, size_t vertexCount, F f)
+    {
+        size_t nThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                           std::min(count, vertexCount / importVerticesPerThread + 1));
+        std::atomic<size_t> nextSubmesh(0);
+        auto worker = [&]()
+        {
+            size_t i;
+            while ((i = nextSubmesh++) < count)
+                f(i);
+        };
+        std::vector<std::thread> threads;
+        for (size_t t = 1; t < nThreads; t++)
+            threads.emplace_back(worker);
+        worker();
+        for (auto &&thread : threads)
+            thread.join();
+    }
+
+    // Converts the submeshes to one mesh. The arrays are sized up front and every submesh fills its
+    // own range, so they are converted concurrently. Returns nullptr when there are no triangles.
+    static std::shared_ptr<Mesh> mergeSubmeshes(std::vector<Submesh> &submeshes)
+    {
+        size_t vertexCount = 0;
+        for (auto &&submesh : submeshes)
+            vertexCount += submesh.aimesh->mNumVertices;
+
+        // triangulated faces with fewer indices are points and lines, they are left out
+        forEachSubmesh(submeshes.size(), vertexCount, [&](size_t s)
+                       {
+                           const aiMesh *aimesh = submeshes[s].aimesh;
+                           size_t triangleCount = 0;
+                           for (unsigned int i = 0; i < aimesh->mNumFaces; i++)
+                               triangleCount += aimesh->mFaces[i].mNumIndices == 3;
+                           submeshes[s].triangleCount = triangleCount; });
+        size_t indexCount = 0;
+        vertexCount = 0;
+        for (auto &&submesh : submeshes)
         {
-            processNode(node->mChildren[i], scene);
+            submesh.vertexBase = vertexCount;
+            submesh.indexBase = indexCount;
+            vertexCount += submesh.aimesh->mNumVertices;
+            indexCount += 3 * submesh.triangleCount;
         }
+        if (indexCount == 0)
+            return nullptr;
+
+        std::vector<Vertex> vertices(vertexCount);
+        std::vector<unsigned int> indices(indexCount);
+        forEachSubmesh(submeshes.size(), vertexCount, [&](size_t s)
+                       { processMesh(submeshes[s], &vertices[submeshes[s].vertexBase], &indices[submeshes[s].indexBase]); });
+        return std::make_shared<Mesh>(std::move(vertices), std::move(indices));
     }
 
-    void processMesh(aiMesh *aimesh, const aiScene *scene)
+    // writes the vertices of the submesh in model space and its triangles, moved to its first vertex
+    static void processMesh(const Submesh &submesh, Vertex *vertices, unsigned int *indices)
     {
-        std::vector<Vertex> vertices;
-        std::vector<unsigned int> indices;
+        const aiMesh *aimesh = submesh.aimesh;
+        glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(submesh.transform)));
+        const aiVector3D *texCoords = aimesh->mTextureCoords[0];
 
         // process vertices
         for (unsigned int i = 0; i < aimesh->mNumVertices; i++)
         {
-            Vertex vertex;
-            glm::vec3 vector;
-            // position
-            vector.x = aimesh->mVertices[i].x;
-            vector.y = aimesh->mVertices[i].y;
-            vector.z = aimesh->mVertices[i].z;
-            vertex.Position = vector;
-            // normals
-            vector.x = aimesh->mNormals[i].x;
-            vector.y = aimesh->mNormals[i].y;
-            vector.z = aimesh->mNormals[i].z;
-            vertex.Normal = vector;
-            // tex coords
-            if (aimesh->mTextureCoords[0]) // does the aimesh contain texture coordinates?
+            const aiVector3D &position = aimesh->mVertices[i];
+            vertices[i].Position = glm::vec3(submesh.transform * glm::vec4(position.x, position.y, position.z, 1.0f));
+            // normals, generated by the importer for the triangles
+            vertices[i].Normal = glm::vec3(0.0f);
+            if (aimesh->mNormals != nullptr)
             {
-                glm::vec2 vec;
-                vec.x = aimesh->mTextureCoords[0][i].x;
-                vec.y = aimesh->mTextureCoords[0][i].y;
-                vertex.TexCoords = vec;
+                const aiVector3D &normal = aimesh->mNormals[i];
+                glm::vec3 transformedNormal = normalMatrix * glm::vec3(normal.x, normal.y, normal.z);
+                float length = glm::length(transformedNormal);
+                if (length > 0.0f)
+                    vertices[i].Normal = transformedNormal / length;
             }
-            else
-                vertex.TexCoords = glm::vec2(0.0f, 0.0f);
-            vertices.push_back(vertex);
+            // tex coords
+            vertices[i].TexCoords = texCoords != nullptr ? glm::vec2(texCoords[i].x, texCoords[i].y) : glm::vec2(0.0f);
         }
         // process faces
+        unsigned int vertexBase = submesh.vertexBase;
         for (unsigned int i = 0; i < aimesh->mNumFaces; i++)
         {
-            aiFace face = aimesh->mFaces[i];
-            for (unsigned int j = 0; j < face.mNumIndices; j++)
-            {
-                indices.push_back(face.mIndices[j]);
-            }
+            const aiFace &face = aimesh->mFaces[i];
+            if (face.mNumIndices != 3)
+                continue;
+            indices[0] = vertexBase + face.mIndices[0];
+            indices[1] = vertexBase + face.mIndices[1];
+            indices[2] = vertexBase + face.mIndices[2];
+            indices += 3;
         }
-        this->mesh = std::make_shared<Mesh>(vertices, indices);
     }
 };
 #endif
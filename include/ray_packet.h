@@ -0,0 +1,178 @@
+// Packets of N coherent rays for the CPU renderer. The rays are stored as structure of arrays
+// and every test loops over the lanes without branches, so the compiler maps a packet to
+// SSE/AVX2/AVX-512 registers depending on the target.
+
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+template <int N>
+struct RayPacket
+{
+    static_assert(N == 4 || N == 8 || N == 16, "ray packets are 4, 8 or 16 rays wide");
+
+    alignas(64) float origin[3][N];
+    alignas(64) float direction[3][N];
+    alignas(64) float dirfrac[3][N];
+    alignas(64) float tMax[N]; // closest hit of every lane, nodes behind it are skipped
+
+    // bounds over the lanes, a whole node is culled with interval arithmetic when every
+    // lane has the same direction sign on all the axes
+    float originMin[3], originMax[3];
+    float dirfracMin[3], dirfracMax[3];
+    bool coherent;
+
+    void setRay(int lane, const glm::vec3 &rayOrigin, const glm::vec3 &rayDirection, float rayTMax)
+    {
+        glm::vec3 rayDirfrac = 1.0f / rayDirection;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            origin[axis][lane] = rayOrigin[axis];
+            direction[axis][lane] = rayDirection[axis];
+            dirfrac[axis][lane] = rayDirfrac[axis];
+        }
+        tMax[lane] = rayTMax;
+    }
+
+    // call once every lane is set
+    void updateBounds()
+    {
+        coherent = true;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            originMin[axis] = *std::min_element(origin[axis], origin[axis] + N);
+            originMax[axis] = *std::max_element(origin[axis], origin[axis] + N);
+            dirfracMin[axis] = *std::min_element(dirfrac[axis], dirfrac[axis] + N);
+            dirfracMax[axis] = *std::max_element(dirfrac[axis], dirfrac[axis] + N);
+            coherent = coherent && std::isfinite(dirfracMin[axis]) && std::isfinite(dirfracMax[axis]) &&
+                       (dirfracMin[axis] > 0.0f || dirfracMax[axis] < 0.0f);
+        }
+    }
+
+    // the same rays in the space of the given transform, with unnormalized directions so t is kept
+    RayPacket transformed(const glm::mat4 &transform) const
+    {
+        RayPacket packet;
+        glm::mat3 linear = glm::mat3(transform);
+        for (int i = 0; i < N; i++)
+        {
+            glm::vec3 o(origin[0][i], origin[1][i], origin[2][i]);
+            glm::vec3 d(direction[0][i], direction[1][i], direction[2][i]);
+            packet.setRay(i, glm::vec3(transform * glm::vec4(o, 1.0f)), linear * d, tMax[i]);
+        }
+        packet.updateBounds();
+        return packet;
+    }
+
+    // True when no lane can reach the box before its closest hit. Every lane crosses the near
+    // plane of each axis at (near - origin) * dirfrac, which the packet bounds contain.
+    bool missesBox(const glm::vec3 &pMin, const glm::vec3 &pMax) const
+    {
+        if (!coherent)
+            return false;
+        float entry = -INFINITY, exit = INFINITY;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            bool positive = dirfracMin[axis] > 0.0f;
+            float nearPlane = positive ? pMin[axis] : pMax[axis];
+            float farPlane = positive ? pMax[axis] : pMin[axis];
+            entry = std::max(entry, boundsProduct(nearPlane - originMax[axis], nearPlane - originMin[axis], dirfracMin[axis], dirfracMax[axis]).x);
+            exit = std::min(exit, boundsProduct(farPlane - originMax[axis], farPlane - originMin[axis], dirfracMin[axis], dirfracMax[axis]).y);
+        }
+        return exit < 0.0f || entry > exit || entry > *std::max_element(tMax, tMax + N);
+    }
+
+    // lanes of laneMask whose ray hits the box before their closest hit, one bit per lane
+    unsigned int intersectBox(const glm::vec3 &pMin, const glm::vec3 &pMax, unsigned int laneMask) const
+    {
+        alignas(64) int hit[N];
+        for (int i = 0; i < N; i++)
+        {
+            float t1 = (pMin.x - origin[0][i]) * dirfrac[0][i];
+            float t2 = (pMax.x - origin[0][i]) * dirfrac[0][i];
+            float t3 = (pMin.y - origin[1][i]) * dirfrac[1][i];
+            float t4 = (pMax.y - origin[1][i]) * dirfrac[1][i];
+            float t5 = (pMin.z - origin[2][i]) * dirfrac[2][i];
+            float t6 = (pMax.z - origin[2][i]) * dirfrac[2][i];
+
+            float tmin = std::max(std::max(std::min(t1, t2), std::min(t3, t4)), std::min(t5, t6));
+            float tmax = std::min(std::min(std::max(t1, t2), std::max(t3, t4)), std::max(t5, t6));
+            // bitwise ands keep the loop free of branches
+            hit[i] = (tmax >= 0.0f) & (tmin <= tmax) & (tmin <= tMax[i]);
+        }
+        unsigned int mask = 0;
+        for (int i = 0; i < N; i++)
+            mask |= hit[i] << i;
+        return mask & laneMask;
+    }
+
+private:
+    // smallest and biggest product of two intervals
+    static glm::vec2 boundsProduct(float aMin, float aMax, float bMin, float bMax)
+    {
+        float p1 = aMin * bMin, p2 = aMin * bMax, p3 = aMax * bMin, p4 = aMax * bMax;
+        return glm::vec2(std::min(std::min(p1, p2), std::min(p3, p4)), std::max(std::max(p1, p2), std::max(p3, p4)));
+    }
+};
+
+// closest hit of every lane, triangle is -1 for the lanes that missed. u and v are the
+// barycentrics of the accepted hit, so the normal is interpolated without a second triangle test
+// that could reject a grazing hit the packet test took.
+template <int N>
+struct PacketHit
+{
+    alignas(64) int triangle[N];
+    alignas(64) int instance[N];
+    alignas(64) float u[N];
+    alignas(64) float v[N];
+};
+
+// one flag per lane of a lane mask, the vectorized tests cannot shift the mask by the lane
+template <int N>
+void unpackLaneMask(unsigned int laneMask, int (&lanes)[N])
+{
+    for (int i = 0; i < N; i++)
+        lanes[i] = (laneMask >> i) & 1u;
+}
+
+// Möller–Trumbore of one triangle against the flagged lanes, the lanes that hit it before
+// their closest hit take it as their new closest hit
+template <int N>
+void intersectTriangle(RayPacket<N> &packet, PacketHit<N> &hit, const int (&lanes)[N], int triangle,
+                       const glm::vec3 &p1, const glm::vec3 &p2, const glm::vec3 &p3, float minDistance)
+{
+    glm::vec3 edge1 = p2 - p1;
+    glm::vec3 edge2 = p3 - p1;
+    for (int i = 0; i < N; i++)
+    {
+        float dx = packet.direction[0][i], dy = packet.direction[1][i], dz = packet.direction[2][i];
+        // h = cross(direction, edge2)
+        float hx = dy * edge2.z - dz * edge2.y;
+        float hy = dz * edge2.x - dx * edge2.z;
+        float hz = dx * edge2.y - dy * edge2.x;
+        float a = edge1.x * hx + edge1.y * hy + edge1.z * hz;
+        float f = 1.0f / a;
+        float sx = packet.origin[0][i] - p1.x, sy = packet.origin[1][i] - p1.y, sz = packet.origin[2][i] - p1.z;
+        float u = f * (sx * hx + sy * hy + sz * hz);
+        // q = cross(s, edge1)
+        float qx = sy * edge1.z - sz * edge1.y;
+        float qy = sz * edge1.x - sx * edge1.z;
+        float qz = sx * edge1.y - sy * edge1.x;
+        float v = f * (dx * qx + dy * qy + dz * qz);
+        float t = f * (edge2.x * qx + edge2.y * qy + edge2.z * qz);
+
+        float closestT = packet.tMax[i];
+        bool valid = lanes[i] & ((a <= -minDistance) | (a >= minDistance)) &
+                     (u >= 0.0f) & (u <= 1.0f) & (v >= 0.0f) & (u + v <= 1.0f) &
+                     (t > minDistance) & (t < closestT);
+        packet.tMax[i] = valid ? t : closestT;
+        hit.triangle[i] = valid ? triangle : hit.triangle[i];
+        hit.u[i] = valid ? u : hit.u[i];
+        hit.v[i] = valid ? v : hit.v[i];
+    }
+}
+#endif
@@ -0,0 +1,53 @@
+// Frame time controller of the progressive renders. It keeps a moving average of the cost of one
+// pixel sample, measured on the renders of the previous frames, and plans how many pixel samples
+// the next frame traces to fill the target frame time. The compute shader and the CPU renderer
+// turn the plan into whole samples, or into bands and tiles of a sample when one sample of the
+// frame costs more than the target.
+
+#ifndef SAMPLE_BUDGET_H
+#define SAMPLE_BUDGET_H
+
+#include <algorithm>
+
+class SampleBudget
+{
+public:
+    // time a frame should spend tracing
+    double targetSeconds = 0.016;
+
+    // Pixel samples the next frame should trace, never less than minimum. The first frames,
+    // before there is a measure, only trace the minimum.
+    unsigned long long plan(unsigned long long minimum) const
+    {
+        if (secondsPerPixelSample <= 0.0)
+            return minimum;
+        return std::max(minimum, static_cast<unsigned long long>(targetSeconds / secondsPerPixelSample));
+    }
+
+    // measured time of pixelSamples traced samples
+    void record(unsigned long long pixelSamples, double seconds)
+    {
+        if (pixelSamples == 0 || seconds <= 0.0)
+            return;
+        double cost = seconds / pixelSamples;
+        // the cost changes with the view, a short average follows it within a few frames
+        secondsPerPixelSample = secondsPerPixelSample > 0.0 ? secondsPerPixelSample + smoothing * (cost - secondsPerPixelSample) : cost;
+    }
+
+    // full frame samples per second of a frame of the given pixel count, 0 before the first measure
+    double getSamplesPerSecond(unsigned long long pixels) const
+    {
+        return secondsPerPixelSample > 0.0 && pixels > 0 ? 1.0 / (secondsPerPixelSample * pixels) : 0.0;
+    }
+
+    // forgets the measure, for a new scene
+    void reset()
+    {
+        secondsPerPixelSample = 0.0;
+    }
+
+private:
+    static constexpr double smoothing = 0.25;
+    double secondsPerPixelSample = 0.0;
+};
+#endif
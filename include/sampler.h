@@ -0,0 +1,63 @@
+// Low discrepancy sampler of the CPU renderer. The functions are the ones of the compute shader,
+// compiled from the same source file with the GLSL types and built-ins taken from glm, so both
+// renderers draw the same samples.
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <glm/glm.hpp>
+
+namespace sampler_glsl
+{
+    using glm::abs;
+    using glm::cos;
+    using glm::max;
+    using glm::sin;
+    using glm::sqrt;
+    using glm::vec2;
+    using glm::vec3;
+    typedef unsigned int uint;
+
+    // GLSL built-in, a byte swap and the bits of every byte
+    inline uint bitfieldReverse(uint x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        x = __builtin_bswap32(x);
+#else
+        x = (x >> 24) | ((x >> 8) & 0x0000ff00u) | ((x << 8) & 0x00ff0000u) | (x << 24);
+#endif
+        x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+        x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+        return ((x >> 4u) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4u);
+    }
+
+#include "../src/shaders/common/sampler.glsl"
+}
+
+// samples of one path, one pair of dimensions after the other like nextSample2D() in the shader
+struct PathSampler
+{
+    unsigned int pixelSeed;
+    unsigned int sampleIndex;
+    unsigned int pair = 0;
+
+    // sample starts at 1 like currentSample
+    PathSampler(unsigned int x, unsigned int y, unsigned int sample)
+        : pixelSeed(sampler_glsl::samplerPixelSeed(x, y)), sampleIndex(sample - 1) {}
+
+    glm::vec2 next2D()
+    {
+        return sampler_glsl::samplerSample2D(pixelSeed, sampleIndex, pair++);
+    }
+
+    glm::vec2 nextDisk()
+    {
+        return sampler_glsl::samplerConcentricDisk(next2D());
+    }
+
+    glm::vec3 nextCosineDirection(const glm::vec3 &normal)
+    {
+        return sampler_glsl::samplerCosineHemisphere(normal, next2D());
+    }
+};
+#endif
@@ -13,7 +13,9 @@
 #include <camera.h>
 #include <object.h>
 #include <compute_shader.h>
-#include <bvh_accelerator.h>
+#include <bvh_scene_accelerator.h>
+#include <sample_budget.h>
+#include <scene_light.h>
 
 enum View_Mode
 {
@@ -42,8 +44,17 @@ public:
     unsigned int uboMatrices;
 
     // compute shaders
-    ComputeShader raytracingShader;
+    ComputeShader raytracingShader, displayShader, tileErrorShader;
     int numTriangles = 1;
+    BVH_Build_Mode bvhBuildMode = PARALLEL_SAH;
+    bool quantizedBVH = false; // the BLAS is uploaded as 16 byte quantized nodes
+    SampleBudget renderBudget; // frame time the progressive render fills and its measured cost
+    // Adaptive sampling: once every pixel has adaptiveMinSamples, only the tiles whose noise is
+    // above adaptiveThreshold get samples, and the render stops when no tile is left. The noise
+    // is the standard error of the pixel luminance in display units.
+    bool adaptiveSampling = true;
+    float adaptiveThreshold = 0.005f;
+    unsigned int adaptiveMinSamples = 16;
 
     // grid
     bool GridDraw = true;
@@ -63,7 +74,9 @@ public:
                                                              gridShader("../src/shaders/grid/vertex.vert", "../src/shaders/grid/fragment.frag"),
                                                              selectionShader("../src/shaders/selection/vertex.vert", "../src/shaders/selection/fragment.frag"),
                                                              gBufferShader("../src/shaders/gbuffer/vertex.vert", "../src/shaders/gbuffer/fragment.frag"),
-                                                             raytracingShader("../src/shaders/raytracing/raytracing.comp")
+                                                             raytracingShader("../src/shaders/raytracing/raytracing.comp"),
+                                                             displayShader("../src/shaders/display/display.comp"),
+                                                             tileErrorShader("../src/shaders/adaptive/tile_error.comp")
     {
         std::cout << "holaScene" << std::endl;
         this->width = width;
@@ -101,14 +114,31 @@ public:
         // set up buffer to store geo data
         glGenBuffers(1, &nodesSamplerBuffer);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, nodesSamplerBuffer);
-        glGenBuffers(1, &objectsSamplerBuffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, objectsSamplerBuffer);
-        glGenBuffers(1, &trianglesSamplerBuffer);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, trianglesSamplerBuffer);
+        glGenBuffers(1, &instancesSamplerBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, instancesSamplerBuffer);
+        glGenBuffers(1, &verticesSamplerBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, verticesSamplerBuffer);
+        glGenBuffers(1, &tlasNodesSamplerBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, tlasNodesSamplerBuffer);
+        glGenBuffers(1, &indicesSamplerBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, indicesSamplerBuffer);
+        glGenBuffers(1, &quantizedNodesSamplerBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, quantizedNodesSamplerBuffer);
+        glGenBuffers(1, &adaptiveTilesBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, adaptiveTilesBuffer);
+        glGenBuffers(1, &lightsBuffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, lightsBuffer);
+        glGenBuffers(1, &activeTilesReadBuffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, activeTilesReadBuffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, sizeof(unsigned int), NULL, GL_STREAM_READ);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
         // setUpGeometryData();
 
         // set up compute texture
         setUpComputeTexture();
+
+        // GPU time of the render dispatches
+        glGenQueries(timerQueries, timerQueryIDs);
     };
 
     void addEye(std::shared_ptr<Camera> camera)
@@ -160,26 +190,7 @@ public:
         glBindRenderbuffer(GL_RENDERBUFFER, 0);
 
         // resize compute textures
-        glBindTexture(GL_TEXTURE_2D, computeTexture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA,
-                     GL_FLOAT, NULL);
-
-        glBindImageTexture(0, computeTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-
-        glBindTexture(GL_TEXTURE_2D, computeTextureHalf);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width / 2, height / 2, 0, GL_RGBA,
-                     GL_FLOAT, NULL);
-
-        glBindImageTexture(1, computeTextureHalf, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        resizeComputeTextures();
 
         resetSampling();
     }
@@ -229,17 +240,46 @@ public:
         case PREVIEW:
             return textureScreenColor;
         case RENDER:
-            if (currentSample == 1)
-                return computeTextureHalf;
-            return computeTexture;
+            updateDisplay();
+            return displayTexture;
         default:
             return 0;
         }
     }
 
+    // samples every pixel has
     unsigned int getSamples()
     {
-        return currentSample;
+        return bandRow > 0 ? currentSample - 1 : currentSample;
+    }
+
+    // full frame samples per second the render sustains
+    double getSamplesPerSecond()
+    {
+        return renderBudget.getSamplesPerSecond((unsigned long long)width * height);
+    }
+
+    // tiles above the noise threshold at the last check, -1 before the first one
+    int getActiveTiles()
+    {
+        return activeTiles;
+    }
+
+    int getTileCount()
+    {
+        return (width / computeGroups + 1) * (height / computeGroups + 1);
+    }
+
+    // every tile is below the noise threshold, the render stopped
+    bool isConverged()
+    {
+        return adaptiveSampling && activeTiles == 0;
+    }
+
+    // checks the tiles again after a change of the adaptive sampling settings
+    void updateAdaptiveSampling()
+    {
+        activeTiles = -1;
     }
 
     void draw()
@@ -357,20 +397,61 @@ public:
         //     gBufferShader.setVec3("color", object->color);
         //     object->draw();
         // }
-        currentSample++;
-
-        useRaytracingShader();
-        if (currentSample == 1)
-            glDispatchCompute(width / 2 + 1, height / 2 + 1, 1);
-        else
-            glDispatchCompute(width / computeGroups + 1, height / computeGroups + 1, 1);
-        // make sure writing to image has finished before read
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        // Progressive render: as many samples as fit into the frame budget, or bands of rows of a
+        // sample when a whole one does not
+        readTimerQueries();
+        readActiveTiles();
+        if (isConverged())
+            return;
+        if (adaptiveSampling && getSamples() >= adaptiveMinSamples)
+            updateTileErrors();
+        unsigned long long plannedPixels = renderBudget.plan((unsigned long long)width * computeGroups);
+        unsigned long long tracedPixels = 0;
+        glBeginQuery(GL_TIME_ELAPSED, timerQueryIDs[timerQueryNext]);
+        while (tracedPixels < plannedPixels)
+        {
+            if (bandRow == 0)
+                currentSample++;
+            // whole work groups of rows, the last band ends at the frame border
+            unsigned long long rowsLeft = (plannedPixels - tracedPixels + width - 1) / width;
+            int rows = int(std::min<unsigned long long>((rowsLeft + computeGroups - 1) / computeGroups * computeGroups, height - bandRow));
+            useRaytracingShader();
+            glDispatchCompute(width / computeGroups + 1, (rows + computeGroups - 1) / computeGroups, 1);
+            // make sure writing to image has finished before read
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+            tracedPixels += (unsigned long long)rows * width;
+            bandRow += rows;
+            if (bandRow >= height)
+                bandRow = 0;
+        }
+        glEndQuery(GL_TIME_ELAPSED);
+        displayOutdated = true;
+        timerQueryPixels[timerQueryNext] = tracedPixels;
+        timerQueryPending[timerQueryNext] = true;
+        timerQueryNext = (timerQueryNext + 1) % timerQueries;
     }
 
     void resetSampling()
     {
         currentSample = 0;
+        bandRow = 0;
+        // the tile errors of the previous view are no longer valid
+        tileErrorsValid = false;
+        activeTiles = -1;
+        if (activeTilesFence != nullptr)
+        {
+            glDeleteSync(activeTilesFence);
+            activeTilesFence = nullptr;
+        }
+    }
+
+    // rebuilds the acceleration structure if it is in use
+    void updateGeometry()
+    {
+        if (viewMode != RENDER)
+            return;
+        setUpGeometryData();
+        resetSampling();
     }
 
     void useSelectionShader(glm::mat4 model, glm::vec3 color)
@@ -412,19 +493,60 @@ public:
         raytracingShader.setFloat("camera.zoom", Eye->Zoom);
         raytracingShader.setFloat("camera.zoom", Eye->Zoom);
         raytracingShader.setInt("currentSample", currentSample);
+        raytracingShader.setInt("rowOffset", bandRow);
         raytracingShader.setInt("numTriangles", numTriangles);
-        if (currentSample == 1)
-        {
-            raytracingShader.setInt("width", width / 2);
-            raytracingShader.setInt("height", height / 2);
-        }
-        else
+        raytracingShader.setInt("numLights", int(lights.size()));
+        raytracingShader.setBool("quantizedBVH", !accelerator.getQuantizedBLASNodes().empty());
+        raytracingShader.setInt("width", width);
+        raytracingShader.setInt("height", height);
+        raytracingShader.setBool("adaptiveSampling", adaptiveSampling && tileErrorsValid);
+        raytracingShader.setInt("tilesX", width / computeGroups + 1);
+    }
+
+    // flags the tiles above the noise threshold for the next dispatches and starts reading their
+    // count back, unless an earlier count is still on its way
+    void updateTileErrors()
+    {
+        unsigned int zero = 0;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, adaptiveTilesBuffer);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), &zero);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        tileErrorShader.use();
+        tileErrorShader.setInt("width", width);
+        tileErrorShader.setInt("height", height);
+        tileErrorShader.setFloat("threshold", adaptiveThreshold);
+        glDispatchCompute(width / computeGroups + 1, height / computeGroups + 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+        tileErrorsValid = true;
+
+        if (activeTilesFence == nullptr)
         {
-            raytracingShader.setInt("width", width);
-            raytracingShader.setInt("height", height);
+            // copied to a buffer of its own, so reading it never waits for later dispatches
+            glBindBuffer(GL_COPY_READ_BUFFER, adaptiveTilesBuffer);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, activeTilesReadBuffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(unsigned int));
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+            activeTilesFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
         }
     }
 
+    // averages and gamma encodes the accumulated samples into the display texture, once per
+    // frame that traced samples
+    void updateDisplay()
+    {
+        if (!displayOutdated)
+            return;
+        displayShader.use();
+        displayShader.setInt("width", width);
+        displayShader.setInt("height", height);
+        glDispatchCompute(width / computeGroups + 1, height / computeGroups + 1, 1);
+        // the GUI samples the texture
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+        displayOutdated = false;
+    }
+
     unsigned int addLine(glm::vec3 pointA, glm::vec3 pointB, glm::vec3 color)
     {
         unsigned int lineVAO;
@@ -507,6 +629,10 @@ public:
         glDeleteRenderbuffers(1, &RBOdepthStencil);
         glDeleteFramebuffers(1, &gBuffer);
         glDeleteRenderbuffers(1, &gRBOdepthStencil);
+        glDeleteQueries(timerQueries, timerQueryIDs);
+        glDeleteBuffers(1, &adaptiveTilesBuffer);
+        glDeleteBuffers(1, &activeTilesReadBuffer);
+        glDeleteBuffers(1, &lightsBuffer);
     }
 
 private:
@@ -520,17 +646,71 @@ private:
     unsigned int gPosition, gNormal, gColorSpec;
 
     // sampler buffer to store geo
-    unsigned int nodesSamplerBuffer, objectsSamplerBuffer, trianglesSamplerBuffer;
+    unsigned int nodesSamplerBuffer, instancesSamplerBuffer, verticesSamplerBuffer, tlasNodesSamplerBuffer, indicesSamplerBuffer;
+    unsigned int quantizedNodesSamplerBuffer;
     unsigned int computeGroups = 20;
 
-    // compute shader textures
-    unsigned int computeTexture, computeTextureHalf;
+    // emitters of the LIGHT objects, rebuilt with the geometry
+    std::vector<SceneLight> lights;
+    unsigned int lightsBuffer;
+
+    // compute shader textures: linear sum and sample count, compensation of the sum, and the image
+    unsigned int accumulationTexture, compensationTexture, displayTexture;
+    bool displayOutdated = false;
 
     // samples
     unsigned int currentSample = 0;
+    int bandRow = 0; // first row of the next band of the sample in progress, 0 between samples
+
+    // GPU time of the dispatches of the last frames, read once the results are available so the
+    // CPU never waits for them
+    static constexpr int timerQueries = 4;
+    unsigned int timerQueryIDs[timerQueries];
+    unsigned long long timerQueryPixels[timerQueries] = {};
+    bool timerQueryPending[timerQueries] = {};
+    int timerQueryNext = 0;
+
+    // adaptive sampling: active flag of every tile after their count, and the count read back
+    unsigned int adaptiveTilesBuffer, activeTilesReadBuffer;
+    bool tileErrorsValid = false;
+    int activeTiles = -1;
+    GLsync activeTilesFence = nullptr;
 
     // acceration structure;
-    BVH_Accelerator accelerator = BVH_Accelerator();
+    BVH_SceneAccelerator accelerator = BVH_SceneAccelerator();
+
+    // count of the active tiles, once the GPU got to it
+    void readActiveTiles()
+    {
+        if (activeTilesFence == nullptr || glClientWaitSync(activeTilesFence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            return;
+        glDeleteSync(activeTilesFence);
+        activeTilesFence = nullptr;
+        unsigned int count = 0;
+        glBindBuffer(GL_COPY_READ_BUFFER, activeTilesReadBuffer);
+        glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(count), &count);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        activeTiles = int(count);
+    }
+
+    // adds the cost of the finished frames to the render budget, oldest first
+    void readTimerQueries()
+    {
+        for (int i = 0; i < timerQueries; i++)
+        {
+            int query = (timerQueryNext + i) % timerQueries;
+            if (!timerQueryPending[query])
+                continue;
+            int available = 0;
+            glGetQueryObjectiv(timerQueryIDs[query], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(timerQueryIDs[query], GL_QUERY_RESULT, &nanoseconds);
+            renderBudget.record(timerQueryPixels[query], nanoseconds * 1e-9);
+            timerQueryPending[query] = false;
+        }
+    }
 
     void generateGridVertices(float step, float size, int &divisions)
     {
@@ -685,77 +865,64 @@ private:
 
     void setUpGeometryData()
     {
-        std::vector<std::shared_ptr<BoundingBox>> bboxes;
-        std::vector<Triangle> modelTriangles;
-
-        for (auto &&obj : Objects)
-        {
-            auto objBboxes = obj->getTrianglesBoundingBoxes();
-            auto objTris = obj->getModelTriangles();
-            bboxes.insert(bboxes.begin(), objBboxes.begin(), objBboxes.end());
-            modelTriangles.insert(modelTriangles.begin(), objTris.begin(), objTris.end());
-        }
-
-        accelerator.buildTree(bboxes, 5);
-        auto tree = accelerator.getBVHTree();
-        auto ordObjectsIndices = accelerator.getOrderedObjects();
+        // only new meshes get a BLAS, moved objects just rebuild the TLAS
+        accelerator.buildMode = bvhBuildMode;
+        accelerator.quantizeBLAS = quantizedBVH;
+        bool bottomLevelChanged = accelerator.update(Objects);
 
-        struct GPU_BVH_Node
+        if (bottomLevelChanged)
         {
-            glm::vec4 childrenId_ObjectInfo, pMin, pMax;
-        };
-
-        struct GPU_BVH_Object
-        {
-            glm::vec4 objInfo;
-        };
-
-        struct GPU_BVH_Triangle
-        {
-            glm::vec4 v1_pos_Nx, v1_nor_Txcoords, v2_pos_Nx, v2_nor_Txcoords, v3_pos_Nx, v3_nor_Txcoords;
-        };
-
-        std::vector<GPU_BVH_Node> nodes(tree.size());
-        std::vector<GPU_BVH_Object> objects = {};
-        std::vector<GPU_BVH_Triangle> triangles = {};
-
-        std::cout << "BVH Nodes buffer: ";
-        GPU_BVH_Node bvhNode;
-        for (auto &&node : tree)
-        {
-            if (node->children[0] == nullptr)
-                bvhNode = GPU_BVH_Node{glm::vec4(-1, -1, node->objectOffset, node->objectCount), glm::vec4(node->bbox.Pmin, 0.0), glm::vec4(node->bbox.Pmax, 0.0)};
-            else
-                bvhNode = GPU_BVH_Node{glm::vec4(node->children[0]->id, node->children[1]->id, 0, 0), glm::vec4(node->bbox.Pmin, 0.0), glm::vec4(node->bbox.Pmax, 0.0)};
-            nodes[node->id] = bvhNode;
-        }
-        std::cout << std::endl;
-
-        int currentOffset = 0;
-        std::cout << "Objects buffer: ";
-        for (auto &&objIndex : ordObjectsIndices)
-        {
-            auto tri = modelTriangles[objIndex];
-            triangles.push_back(GPU_BVH_Triangle{glm::vec4(tri.P1.Position, tri.P1.Normal.x),
-                                                 glm::vec4(tri.P1.Normal.y, tri.P1.Normal.z, tri.P1.TexCoords.x, tri.P1.TexCoords.y),
-                                                 glm::vec4(tri.P2.Position, tri.P2.Normal.x),
-                                                 glm::vec4(tri.P2.Normal.y, tri.P2.Normal.z, tri.P2.TexCoords.x, tri.P2.TexCoords.y),
-                                                 glm::vec4(tri.P3.Position, tri.P3.Normal.x),
-                                                 glm::vec4(tri.P3.Normal.y, tri.P3.Normal.z, tri.P3.TexCoords.x, tri.P3.TexCoords.y)});
+            // the texture coordinates fill the w components of position and normal
+            struct GPU_BVH_Vertex
+            {
+                glm::vec4 pos_Tx, nor_Ty;
+            };
+
+            // only the BLAS nodes the shader reads are uploaded, the other buffer is left empty
+            const std::vector<BVH_QuantizedNode> &quantizedNodes = accelerator.getQuantizedBLASNodes();
+            std::vector<BVH_LinearNode> noNodes;
+            const std::vector<BVH_LinearNode> &nodes = quantizedNodes.empty() ? accelerator.getBLASNodes() : noNodes;
+            const std::vector<Vertex> &modelVertices = accelerator.getVertices();
+            const std::vector<unsigned int> &indices = accelerator.getTriangleIndices();
+            std::vector<GPU_BVH_Vertex> vertices = {};
+            vertices.reserve(modelVertices.size());
+            for (auto &&vertex : modelVertices)
+                vertices.push_back(GPU_BVH_Vertex{glm::vec4(vertex.Position, vertex.TexCoords.x),
+                                                  glm::vec4(vertex.Normal, vertex.TexCoords.y)});
+
+            // Bind the buffer object for the BLAS nodes, the linearized trees are uploaded as is
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodesSamplerBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, nodes.size() * sizeof(BVH_LinearNode), nodes.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, quantizedNodesSamplerBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, quantizedNodes.size() * sizeof(BVH_QuantizedNode), quantizedNodes.data(), GL_STATIC_DRAW);
+
+            // Bind the buffer object for vertices
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, verticesSamplerBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, vertices.size() * sizeof(GPU_BVH_Vertex), vertices.data(), GL_STATIC_DRAW);
+
+            // Bind the buffer object for the triangle indices
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, indicesSamplerBuffer);
+            glBufferData(GL_SHADER_STORAGE_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+
+            std::cout << "Geometry buffers: " << indices.size() / 3 << " triangles, "
+                      << (vertices.size() * sizeof(GPU_BVH_Vertex) + indices.size() * sizeof(unsigned int)) / 1024 << " KB, BLAS nodes "
+                      << (nodes.size() * sizeof(BVH_LinearNode) + quantizedNodes.size() * sizeof(BVH_QuantizedNode)) / 1024 << " KB" << std::endl;
         }
-        std::cout << std::endl;
 
-        // Bind the buffer object for nodes
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, nodesSamplerBuffer);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, nodes.size() * sizeof(GPU_BVH_Node), nodes.data(), GL_STATIC_DRAW);
+        // Bind the buffer object for the TLAS nodes
+        const std::vector<BVH_LinearNode> &tlasNodes = accelerator.getTLASNodes();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, tlasNodesSamplerBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, tlasNodes.size() * sizeof(BVH_LinearNode), tlasNodes.data(), GL_DYNAMIC_DRAW);
 
-        // Bind the buffer object for objects
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, objectsSamplerBuffer);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, objects.size() * sizeof(GPU_BVH_Object), objects.data(), GL_STATIC_DRAW);
+        // Bind the buffer object for instances
+        const std::vector<BVH_Instance> &instances = accelerator.getInstances();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, instancesSamplerBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, instances.size() * sizeof(BVH_Instance), instances.data(), GL_DYNAMIC_DRAW);
 
-        // Bind the buffer object for triangles
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, trianglesSamplerBuffer);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, triangles.size() * sizeof(GPU_BVH_Triangle), triangles.data(), GL_STATIC_DRAW);
+        // Bind the buffer object for the lights, few enough to rebuild on every change
+        lights = SceneLight::collect(Objects);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightsBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, lights.size() * sizeof(SceneLight), lights.data(), GL_DYNAMIC_DRAW);
 
         // Unbind the buffer object and texture
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
@@ -779,34 +946,39 @@ private:
         // glBindTexture(GL_TEXTURE_BUFFER, 0);
     }
 
-    void
-    setUpComputeTexture()
+    void setUpComputeTexture()
     {
+        glGenTextures(1, &accumulationTexture);
+        glGenTextures(1, &compensationTexture);
+        glGenTextures(1, &displayTexture);
+        resizeComputeTextures();
+    }
 
-        glGenTextures(1, &computeTexture);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, computeTexture);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA,
-                     GL_FLOAT, NULL);
+    // accumulation and compensation are only written by the raytracing shader, the display
+    // texture is filtered by the GUI. The tile flags follow the frame size.
+    void resizeComputeTextures()
+    {
+        glBindTexture(GL_TEXTURE_2D, accumulationTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+        glBindImageTexture(0, accumulationTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
-        glBindImageTexture(0, computeTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glBindTexture(GL_TEXTURE_2D, compensationTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+        glBindImageTexture(1, compensationTexture, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
-        glGenTextures(1, &computeTextureHalf);
-        glActiveTexture(GL_TEXTURE1);
-        glBindTexture(GL_TEXTURE_2D, computeTextureHalf);
+        glBindTexture(GL_TEXTURE_2D, displayTexture);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, width / 2, height / 2, 0, GL_RGBA,
-                     GL_FLOAT, NULL);
-
-        glBindImageTexture(1, computeTextureHalf, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindImageTexture(2, displayTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
         glBindTexture(GL_TEXTURE_2D, 0);
+
+        // active tile count and one flag per tile of the raytracing dispatch
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, adaptiveTilesBuffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (1 + getTileCount()) * sizeof(unsigned int), NULL, GL_DYNAMIC_COPY);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
     }
 };
 #endif
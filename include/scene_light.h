@@ -0,0 +1,37 @@
+// Emitters of the path tracers. Every LIGHT object is a sphere at its location, of half its
+// largest scale, with a constant radiance of its color times its strength. The list is uploaded
+// as is to the compute shader, two vec4 per light in std430.
+
+#ifndef SCENE_LIGHT_H
+#define SCENE_LIGHT_H
+
+#include <glm/glm.hpp>
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <object.h>
+
+struct SceneLight
+{
+    glm::vec4 positionRadius; // world center in xyz, radius in w
+    glm::vec4 emission;       // radiance in rgb
+
+    // the lights of the objects, in scene order
+    static std::vector<SceneLight> collect(const std::vector<std::shared_ptr<Object>> &objects)
+    {
+        std::vector<SceneLight> lights;
+        for (auto &&object : objects)
+        {
+            if (object->meshType != LIGHT)
+                continue;
+            float radius = 0.5f * std::max(object->scale.x, std::max(object->scale.y, object->scale.z));
+            lights.push_back(SceneLight{glm::vec4(object->location, radius),
+                                        glm::vec4(object->color * object->lightStrength, 0.0f)});
+        }
+        return lights;
+    }
+};
+static_assert(sizeof(SceneLight) == 32, "SceneLight must match the std430 layout of the shader");
+#endif
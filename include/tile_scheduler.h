@@ -0,0 +1,237 @@
+// Tile scheduler of the CPU renderer. The frame is split into square tiles, ordered along a Morton
+// curve or a spiral out of the center, and dealt round robin to one deque per thread. A thread
+// works through its own deque from the front and, once it is empty, steals from the back of the
+// others, so the threads that drew the expensive tiles are helped by the ones that drew the sky.
+
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+enum Tile_Order
+{
+    MORTON_ORDER,
+    SPIRAL_ORDER
+};
+
+struct RenderTile
+{
+    int x0, y0, x1, y1; // pixels [x0, x1) x [y0, y1)
+    int index;          // position in the tile order
+};
+
+class TileScheduler
+{
+public:
+    // tile edge in pixels, smaller tiles balance better and cost more scheduling
+    int tileSize = 32;
+    Tile_Order order = MORTON_ORDER;
+    // Called by the thread that finished a tile, from every worker thread, so it has to be
+    // thread safe. tilesDone counts the tiles finished in the current run, this one included, out
+    // of the tileCount tiles of the run.
+    std::function<void(const RenderTile &tile, int tilesDone, int tileCount)> onTileDone;
+
+    // stats of the last run
+    unsigned long long tilesStolen = 0;
+
+    // splits the frame into tiles, only rebuilds them when the frame or the settings changed
+    void setUp(int width, int height)
+    {
+        if (width == tilesWidth && height == tilesHeight && tileSize == tilesTileSize && order == tilesOrder)
+            return;
+        tilesWidth = width;
+        tilesHeight = height;
+        tilesTileSize = tileSize;
+        tilesOrder = order;
+
+        int size = std::max(tileSize, 1);
+        int tilesX = (width + size - 1) / size, tilesY = (height + size - 1) / size;
+        std::vector<std::pair<uint64_t, RenderTile>> keyed;
+        keyed.reserve(size_t(tilesX) * tilesY);
+        for (int ty = 0; ty < tilesY; ty++)
+            for (int tx = 0; tx < tilesX; tx++)
+            {
+                RenderTile tile = {tx * size, ty * size, std::min((tx + 1) * size, width), std::min((ty + 1) * size, height), 0};
+                keyed.push_back({order == SPIRAL_ORDER ? spiralKey(tx, ty, tilesX, tilesY) : mortonKey(tx, ty), tile});
+            }
+        std::stable_sort(keyed.begin(), keyed.end(), [](const auto &a, const auto &b)
+                         { return a.first < b.first; });
+
+        tiles.resize(keyed.size());
+        for (size_t i = 0; i < keyed.size(); i++)
+        {
+            tiles[i] = keyed[i].second;
+            tiles[i].index = int(i);
+        }
+    }
+
+    const std::vector<RenderTile> &getTiles() const
+    {
+        return tiles;
+    }
+
+    int getTileCount() const
+    {
+        return int(tiles.size());
+    }
+
+    // tiles finished by the current run, or all of its tiles once it returned
+    int getTilesDone() const
+    {
+        return tilesDone;
+    }
+
+    // Runs work(tile, thread) for the tiles [firstTile, lastTile) on numThreads threads, the
+    // calling thread being thread 0, and returns when all of them are done. lastTile -1 runs to
+    // the last tile.
+    template <typename F>
+    void run(unsigned int numThreads, F work, int firstTile = 0, int lastTile = -1)
+    {
+        firstTile = std::max(0, std::min(firstTile, int(tiles.size())));
+        lastTile = lastTile < 0 ? int(tiles.size()) : std::max(firstTile, std::min(lastTile, int(tiles.size())));
+        std::vector<int> tileIndices(lastTile - firstTile);
+        for (int i = firstTile; i < lastTile; i++)
+            tileIndices[i - firstTile] = i;
+        run(numThreads, work, tileIndices);
+    }
+
+    // runs work(tile, thread) for the listed tiles, in the order of the list
+    template <typename F>
+    void run(unsigned int numThreads, F work, const std::vector<int> &tileIndices)
+    {
+        int tileCount = int(tileIndices.size());
+        numThreads = std::max(1u, std::min<unsigned int>(numThreads, std::max(tileCount, 1)));
+        tilesDone = 0;
+
+        // thread t gets the tiles t, t + numThreads, ..., which keeps the finishing order close
+        // to the tile order while every deque spans the whole frame
+        std::vector<int> slots(tileCount);
+        std::vector<TileDeque> deques(numThreads);
+        size_t slot = 0;
+        for (unsigned int t = 0; t < numThreads; t++)
+        {
+            uint32_t first = uint32_t(slot);
+            for (int i = t; i < tileCount; i += numThreads)
+                slots[slot++] = tileIndices[i];
+            deques[t].slots = slots.data();
+            deques[t].range = packRange(first, uint32_t(slot));
+        }
+
+        std::atomic<unsigned long long> steals(0);
+        auto worker = [&](unsigned int thread)
+        {
+            unsigned long long threadSteals = 0;
+            uint32_t victimSeed = thread * 0x9e3779b9u + 1u;
+            while (true)
+            {
+                int tile = deques[thread].popFront();
+                // own deque empty, steal from the back of another one, starting at a random
+                // victim so the thieves spread out. Nothing is pushed during a run, so when all
+                // deques are empty the thread is done.
+                if (tile < 0 && numThreads > 1)
+                {
+                    victimSeed ^= victimSeed << 13;
+                    victimSeed ^= victimSeed >> 17;
+                    victimSeed ^= victimSeed << 5;
+                    unsigned int firstVictim = victimSeed % numThreads;
+                    for (unsigned int i = 0; tile < 0 && i < numThreads; i++)
+                    {
+                        unsigned int victim = (firstVictim + i) % numThreads;
+                        if (victim != thread)
+                            tile = deques[victim].stealBack();
+                    }
+                    if (tile >= 0)
+                        threadSteals++;
+                }
+                if (tile < 0)
+                    break;
+                work(tiles[tile], thread);
+                int done = ++tilesDone;
+                if (onTileDone)
+                    onTileDone(tiles[tile], done, tileCount);
+            }
+            steals += threadSteals;
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned int t = 1; t < numThreads; t++)
+            threads.emplace_back(worker, t);
+        worker(0);
+        for (auto &&thread : threads)
+            thread.join();
+        tilesStolen = steals;
+    }
+
+private:
+    // Tiles of one thread, slots[front, back) packed in one word. The owner takes the front and
+    // thieves the back, both with a compare and swap on the same word. Front only grows and back
+    // only shrinks, so a stale value can never be swapped in.
+    struct alignas(64) TileDeque
+    {
+        std::atomic<uint64_t> range{0};
+        const int *slots = nullptr;
+
+        int popFront()
+        {
+            uint64_t current = range.load(std::memory_order_relaxed);
+            while (true)
+            {
+                uint32_t front = uint32_t(current), back = uint32_t(current >> 32);
+                if (front >= back)
+                    return -1;
+                if (range.compare_exchange_weak(current, packRange(front + 1, back), std::memory_order_acq_rel, std::memory_order_relaxed))
+                    return slots[front];
+            }
+        }
+
+        int stealBack()
+        {
+            uint64_t current = range.load(std::memory_order_relaxed);
+            while (true)
+            {
+                uint32_t front = uint32_t(current), back = uint32_t(current >> 32);
+                if (front >= back)
+                    return -1;
+                if (range.compare_exchange_weak(current, packRange(front, back - 1), std::memory_order_acq_rel, std::memory_order_relaxed))
+                    return slots[back - 1];
+            }
+        }
+    };
+
+    std::vector<RenderTile> tiles;
+    std::atomic<int> tilesDone{0};
+    // frame and settings the tiles were built for
+    int tilesWidth = -1, tilesHeight = -1, tilesTileSize = -1;
+    Tile_Order tilesOrder = MORTON_ORDER;
+
+    static uint64_t packRange(uint32_t front, uint32_t back)
+    {
+        return uint64_t(front) | (uint64_t(back) << 32);
+    }
+
+    // interleaves the bits of the tile coordinates, neighbouring keys are neighbouring tiles
+    static uint64_t mortonKey(int tx, int ty)
+    {
+        uint64_t key = 0;
+        for (int bit = 0; bit < 16; bit++)
+            key |= (uint64_t((tx >> bit) & 1) << (2 * bit)) | (uint64_t((ty >> bit) & 1) << (2 * bit + 1));
+        return key;
+    }
+
+    // ring around the center tile first, then the angle inside the ring, so the center of the
+    // image is finished first
+    static uint64_t spiralKey(int tx, int ty, int tilesX, int tilesY)
+    {
+        float dx = tx + 0.5f - tilesX * 0.5f, dy = ty + 0.5f - tilesY * 0.5f;
+        uint64_t ring = uint64_t(std::max(std::fabs(dx), std::fabs(dy)));
+        float angle = std::atan2(dy, dx) + 3.14159265f; // [0, 2 pi]
+        return (ring << 32) | uint64_t(angle * 100000.0f);
+    }
+};
+#endif
@@ -0,0 +1,530 @@
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+#include <camera.h>
+#include <object.h>
+#include <cpu_renderer.h>
+
+// settings
+unsigned int MAX_OBJECTS = 100000;
+unsigned int WIDTH = 640;
+unsigned int HEIGHT = 360;
+std::string MODEL_PATH = "";
+
+void printUsage()
+{
+    std::cout << "usage: raytracer_benchmark [-n max_objects] [-w width] [-h height] [-m model.obj]" << std::endl;
+}
+
+// object constructors and builders log every step, which would bury the tables
+struct QuietLog
+{
+    std::ostringstream sink;
+    std::streambuf *log;
+    QuietLog() : log(std::cout.rdbuf(sink.rdbuf())) {}
+    ~QuietLog() { std::cout.rdbuf(log); }
+};
+
+double elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+// cubes on a grid, every object gets its own copy of the mesh unless shareMesh is set
+std::vector<std::shared_ptr<Object>> createObjects(unsigned int count, bool shareMesh)
+{
+    std::vector<std::shared_ptr<Object>> objects;
+    objects.reserve(count);
+    int side = std::max(1, int(std::cbrt(count)));
+    for (unsigned int i = 0; i < count; i++)
+    {
+        std::shared_ptr<Object> cube = std::make_shared<Object>(std::string("Cube"), MESH);
+        if (!shareMesh)
+            cube->mesh = std::make_shared<Mesh>(cube->mesh->vertices, cube->mesh->indices);
+        cube->location = 1.5f * glm::vec3(i % side, (i / side) % side, i / (side * side));
+        objects.push_back(cube);
+    }
+    return objects;
+}
+
+// the imported model, or a UV sphere of about 260k triangles when there is none
+std::shared_ptr<Object> createHighPolyObject()
+{
+    if (!MODEL_PATH.empty())
+        return std::make_shared<Object>(std::string("Model"), IMPORTED, MODEL_PATH);
+
+    const int rings = 256, segments = 512;
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    for (int ring = 0; ring <= rings; ring++)
+    {
+        for (int segment = 0; segment <= segments; segment++)
+        {
+            float theta = glm::pi<float>() * ring / rings, phi = 2.0f * glm::pi<float>() * segment / segments;
+            Vertex vertex;
+            vertex.Normal = glm::vec3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+            vertex.Position = vertex.Normal;
+            vertex.TexCoords = glm::vec2(float(segment) / segments, float(ring) / rings);
+            vertices.push_back(vertex);
+        }
+    }
+    for (int ring = 0; ring < rings; ring++)
+    {
+        for (int segment = 0; segment < segments; segment++)
+        {
+            unsigned int first = ring * (segments + 1) + segment, second = first + segments + 1;
+            unsigned int quad[] = {first, second, first + 1, second, second + 1, first + 1};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    std::shared_ptr<Object> sphere = std::make_shared<Object>(std::string("Sphere"), MESH);
+    sphere->mesh = std::make_shared<Mesh>(vertices, indices);
+    return sphere;
+}
+
+// Diagonal beams of 8 sided prisms in a 10 unit cube, every side is two triangles spanning the
+// whole beam, so the triangle bounds are long and overlap like in architectural scans
+std::shared_ptr<Object> createBeamsObject()
+{
+    const int beams = 1000, sides = 8;
+    std::mt19937 random(7);
+    std::uniform_real_distribution<float> uniform(-5.0f, 5.0f);
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    for (int beam = 0; beam < beams; beam++)
+    {
+        glm::vec3 start(uniform(random), uniform(random), uniform(random));
+        glm::vec3 axis = glm::normalize(glm::vec3(uniform(random), uniform(random), uniform(random)));
+        glm::vec3 end = start + 3.0f * axis;
+        glm::vec3 side = glm::normalize(glm::cross(axis, std::abs(axis.y) < 0.9f ? glm::vec3(0.0f, 1.0f, 0.0f) : glm::vec3(1.0f, 0.0f, 0.0f)));
+        glm::vec3 up = glm::cross(side, axis);
+        unsigned int first = vertices.size();
+        for (int i = 0; i < sides; i++)
+        {
+            float angle = 2.0f * glm::pi<float>() * i / sides;
+            Vertex vertex;
+            vertex.Normal = std::cos(angle) * side + std::sin(angle) * up;
+            vertex.TexCoords = glm::vec2(0.0f);
+            vertex.Position = start + 0.03f * vertex.Normal;
+            vertices.push_back(vertex);
+            vertex.Position = end + 0.03f * vertex.Normal;
+            vertices.push_back(vertex);
+        }
+        for (int i = 0; i < sides; i++)
+        {
+            unsigned int a = first + 2 * i, b = first + 2 * ((i + 1) % sides);
+            unsigned int quad[] = {a, a + 1, b, b, a + 1, b + 1};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    std::shared_ptr<Object> object = std::make_shared<Object>(std::string("Beams"), MESH);
+    object->mesh = std::make_shared<Mesh>(vertices, indices);
+    return object;
+}
+
+// Closed room of slabs around [-2, 2] x [-1.5, 1.5] x [-2, 2], two cubes on the floor and one
+// small light under the ceiling, so every path has to find the light
+std::vector<std::shared_ptr<Object>> createRoomObjects()
+{
+    const glm::vec3 boxes[][2] = {{glm::vec3(0.0f, -1.6f, 0.0f), glm::vec3(4.4f, 0.2f, 4.4f)},
+                                  {glm::vec3(0.0f, 1.6f, 0.0f), glm::vec3(4.4f, 0.2f, 4.4f)},
+                                  {glm::vec3(-2.1f, 0.0f, 0.0f), glm::vec3(0.2f, 3.4f, 4.4f)},
+                                  {glm::vec3(2.1f, 0.0f, 0.0f), glm::vec3(0.2f, 3.4f, 4.4f)},
+                                  {glm::vec3(0.0f, 0.0f, -2.1f), glm::vec3(4.4f, 3.4f, 0.2f)},
+                                  {glm::vec3(0.0f, 0.0f, 2.1f), glm::vec3(4.4f, 3.4f, 0.2f)},
+                                  {glm::vec3(-0.8f, -1.0f, -0.6f), glm::vec3(1.0f)},
+                                  {glm::vec3(-0.2f, -1.2f, 0.9f), glm::vec3(0.6f)}};
+    std::vector<std::shared_ptr<Object>> objects;
+    for (auto &&box : boxes)
+    {
+        std::shared_ptr<Object> cube = std::make_shared<Object>(std::string("Cube"), MESH);
+        cube->location = box[0];
+        cube->scale = box[1];
+        objects.push_back(cube);
+    }
+    std::shared_ptr<Object> light = std::make_shared<Object>(std::string("Light"), LIGHT);
+    light->location = glm::vec3(0.0f, 1.2f, 0.0f);
+    objects.push_back(light);
+    return objects;
+}
+
+// geometry setup time of the CPU renderer for increasing object counts
+void benchmarkGeometrySetUp()
+{
+    std::cout << "\nGeometry set up (ms)\n"
+              << std::setw(10) << "objects" << std::setw(12) << "triangles"
+              << std::setw(14) << "unique build" << std::setw(14) << "shared build" << std::setw(12) << "move one" << std::endl;
+
+    for (unsigned int count = 100; count <= MAX_OBJECTS; count *= 10)
+    {
+        double buildMs[2];
+        double moveMs = 0.0;
+        for (int shareMesh = 0; shareMesh < 2; shareMesh++)
+        {
+            QuietLog quiet;
+            std::vector<std::shared_ptr<Object>> objects = createObjects(count, shareMesh);
+            CPURenderer renderer(1, 1);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            renderer.setUpGeometryData(objects);
+            buildMs[shareMesh] = elapsedMs(start);
+
+            if (shareMesh)
+            {
+                objects[0]->translate(glm::vec3(0.0f, 0.1f, 0.0f));
+                start = std::chrono::high_resolution_clock::now();
+                renderer.setUpGeometryData(objects);
+                moveMs = elapsedMs(start);
+            }
+        }
+        std::cout << std::setw(10) << count << std::setw(12) << count * 12
+                  << std::setw(14) << buildMs[0] << std::setw(14) << buildMs[1] << std::setw(12) << moveMs << std::endl;
+    }
+}
+
+// CPU render speed of single rays and packets, for primary rays only and for full paths
+void benchmarkPacketTraversal()
+{
+    std::cout << "\nCPU tracing of 1000 cubes, " << WIDTH << "x" << HEIGHT << " (Mrays/s)\n"
+              << std::setw(10) << "packet" << std::setw(14) << "primary" << std::setw(14) << "8 bounces" << std::endl;
+
+    std::unique_ptr<QuietLog> quiet(new QuietLog());
+    Camera camera(glm::vec3(-4.0f, 6.0f, -4.0f), glm::vec3(0.0f, 1.0f, 0.0f), 45.0f, -30.0f, WIDTH, HEIGHT);
+    std::vector<std::shared_ptr<Object>> objects = createObjects(1000, true);
+    CPURenderer renderer(WIDTH, HEIGHT);
+    renderer.setUpGeometryData(objects);
+    quiet.reset();
+
+    int packetSizes[] = {1, 4, 8, 16};
+    for (int packetSize : packetSizes)
+    {
+        renderer.packetSize = packetSize;
+        double mraysPerSecond[2];
+        for (int i = 0; i < 2; i++)
+        {
+            renderer.maxBounces = i == 0 ? 1 : 8;
+            renderer.resetSampling();
+            renderer.render(camera, 4);
+            mraysPerSecond[i] = renderer.raysTraced / renderer.renderSeconds / 1e6;
+        }
+        std::cout << std::setw(10) << packetSize << std::setw(14) << mraysPerSecond[0] << std::setw(14) << mraysPerSecond[1] << std::endl;
+    }
+}
+
+// node visits and speed of single rays over the binary and the collapsed wide BVHs
+void benchmarkWideBVH()
+{
+    std::cout << "\nCPU single ray tracing, 8 bounces, " << WIDTH << "x" << HEIGHT << "\n"
+              << std::setw(10) << "scene" << std::setw(8) << "BVH" << std::setw(12) << "Mrays/s" << std::setw(16) << "visits/ray" << std::endl;
+
+    std::unique_ptr<QuietLog> quiet(new QuietLog());
+    std::vector<std::shared_ptr<Object>> scenes[2];
+    scenes[0] = createObjects(1000, true);
+    scenes[1].push_back(createHighPolyObject());
+    Camera cameras[] = {Camera(glm::vec3(-4.0f, 6.0f, -4.0f), glm::vec3(0.0f, 1.0f, 0.0f), 45.0f, -30.0f, WIDTH, HEIGHT),
+                        Camera(glm::vec3(3.0f, 0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 180.0f, 0.0f, WIDTH, HEIGHT)};
+    const char *sceneNames[] = {"cubes", MODEL_PATH.empty() ? "sphere" : "model"};
+    quiet.reset();
+
+    for (int scene = 0; scene < 2; scene++)
+    {
+        if (scenes[scene][0]->mesh == nullptr)
+            continue;
+        int bvhWidths[] = {2, 4, 8};
+        for (int bvhWidth : bvhWidths)
+        {
+            CPURenderer renderer(WIDTH, HEIGHT);
+            renderer.packetSize = 1;
+            renderer.bvhWidth = bvhWidth;
+            quiet.reset(new QuietLog());
+            renderer.setUpGeometryData(scenes[scene]);
+            quiet.reset();
+            renderer.render(cameras[scene], 4);
+            std::cout << std::setw(10) << sceneNames[scene] << std::setw(8) << bvhWidth
+                      << std::setw(12) << renderer.raysTraced / renderer.renderSeconds / 1e6
+                      << std::setw(16) << double(renderer.nodeVisits) / renderer.raysTraced << std::endl;
+        }
+    }
+}
+
+// BLAS node buffer size and single ray speed with the float and the quantized BLAS nodes
+void benchmarkQuantizedBVH()
+{
+    std::cout << "\nCPU binary BVH, single rays, 8 bounces, " << WIDTH << "x" << HEIGHT << "\n"
+              << std::setw(10) << "scene" << std::setw(12) << "nodes" << std::setw(12) << "KB" << std::setw(12) << "Mrays/s" << std::endl;
+
+    std::unique_ptr<QuietLog> quiet(new QuietLog());
+    std::vector<std::shared_ptr<Object>> scenes[2];
+    scenes[0] = createObjects(1000, false);
+    scenes[1].push_back(createHighPolyObject());
+    Camera cameras[] = {Camera(glm::vec3(-4.0f, 6.0f, -4.0f), glm::vec3(0.0f, 1.0f, 0.0f), 45.0f, -30.0f, WIDTH, HEIGHT),
+                        Camera(glm::vec3(3.0f, 0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 180.0f, 0.0f, WIDTH, HEIGHT)};
+    const char *sceneNames[] = {"cubes", MODEL_PATH.empty() ? "sphere" : "model"};
+    quiet.reset();
+
+    for (int scene = 0; scene < 2; scene++)
+    {
+        if (scenes[scene][0]->mesh == nullptr)
+            continue;
+        for (int quantized = 0; quantized < 2; quantized++)
+        {
+            CPURenderer renderer(WIDTH, HEIGHT);
+            renderer.packetSize = 1;
+            renderer.bvhWidth = 2;
+            renderer.quantizedBVH = quantized;
+            quiet.reset(new QuietLog());
+            renderer.setUpGeometryData(scenes[scene]);
+            quiet.reset();
+            renderer.render(cameras[scene], 4);
+
+            BVH_SceneAccelerator accelerator;
+            accelerator.quantizeBLAS = quantized;
+            quiet.reset(new QuietLog());
+            accelerator.update(scenes[scene]);
+            quiet.reset();
+            size_t bytes = quantized ? accelerator.getQuantizedBLASNodes().size() * sizeof(BVH_QuantizedNode)
+                                     : accelerator.getBLASNodes().size() * sizeof(BVH_LinearNode);
+            std::cout << std::setw(10) << sceneNames[scene] << std::setw(12) << (quantized ? "quantized" : "float")
+                      << std::setw(12) << bytes / 1024 << std::setw(12) << renderer.raysTraced / renderer.renderSeconds / 1e6 << std::endl;
+        }
+    }
+}
+
+// BLAS build cost and trace speed of object split SAH against SBVH
+void benchmarkSpatialSplits()
+{
+    std::cout << "\nBLAS builders, CPU binary BVH, single rays, 1 sample, 8 bounces, " << WIDTH << "x" << HEIGHT << "\n"
+              << std::setw(10) << "scene" << std::setw(8) << "BVH" << std::setw(12) << "build ms" << std::setw(12) << "references"
+              << std::setw(12) << "SAH cost" << std::setw(12) << "Mrays/s" << std::setw(16) << "visits/ray" << std::endl;
+
+    std::unique_ptr<QuietLog> quiet(new QuietLog());
+    std::vector<std::shared_ptr<Object>> scenes[2];
+    scenes[0].push_back(createBeamsObject());
+    scenes[1].push_back(createHighPolyObject());
+    Camera cameras[] = {Camera(glm::vec3(-9.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, 0.0f, WIDTH, HEIGHT),
+                        Camera(glm::vec3(3.0f, 0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 180.0f, 0.0f, WIDTH, HEIGHT)};
+    const char *sceneNames[] = {"beams", MODEL_PATH.empty() ? "sphere" : "model"};
+    quiet.reset();
+
+    BVH_Build_Mode buildModes[] = {SAH, SBVH};
+    for (int scene = 0; scene < 2; scene++)
+    {
+        const std::shared_ptr<Mesh> &mesh = scenes[scene][0]->mesh;
+        if (mesh == nullptr)
+            continue;
+        std::vector<BoundingBox> bboxes(mesh->getTriangleCount());
+        std::vector<glm::vec3> triangles(mesh->indices.size());
+        for (size_t i = 0; i < triangles.size(); i++)
+            triangles[i] = mesh->vertices[mesh->indices[i]].Position;
+        for (size_t i = 0; i < bboxes.size(); i++)
+        {
+            bboxes[i].Pmin = glm::min(glm::min(triangles[3 * i], triangles[3 * i + 1]), triangles[3 * i + 2]);
+            bboxes[i].Pmax = glm::max(glm::max(triangles[3 * i], triangles[3 * i + 1]), triangles[3 * i + 2]);
+        }
+
+        for (BVH_Build_Mode buildMode : buildModes)
+        {
+            BVH_Accelerator accelerator;
+            accelerator.buildMode = buildMode;
+            accelerator.logBuilds = false;
+            auto start = std::chrono::high_resolution_clock::now();
+            accelerator.buildTree(bboxes, 5, &triangles);
+            double buildMs = elapsedMs(start);
+
+            CPURenderer renderer(WIDTH, HEIGHT);
+            renderer.packetSize = 1;
+            renderer.bvhWidth = 2;
+            renderer.bvhBuildMode = buildMode;
+            quiet.reset(new QuietLog());
+            renderer.setUpGeometryData(scenes[scene]);
+            quiet.reset();
+            renderer.render(cameras[scene], 1);
+            std::cout << std::setw(10) << sceneNames[scene] << std::setw(8) << (buildMode == SBVH ? "SBVH" : "SAH")
+                      << std::setw(12) << buildMs << std::setw(12) << accelerator.getOrderedObjects().size()
+                      << std::setw(12) << accelerator.getSAHCost()
+                      << std::setw(12) << renderer.raysTraced / renderer.renderSeconds / 1e6
+                      << std::setw(16) << double(renderer.nodeVisits) / renderer.raysTraced << std::endl;
+        }
+    }
+}
+
+// rays/sec of the path at a time megakernel against the wavefront stages, single rays
+void benchmarkWavefront()
+{
+    std::cout << "\nCPU megakernel and wavefront, single rays, 4 samples, 8 bounces, " << WIDTH << "x" << HEIGHT << "\n"
+              << std::setw(10) << "scene" << std::setw(12) << "mode" << std::setw(12) << "tile" << std::setw(12) << "Mrays/s" << std::setw(16) << "visits/ray" << std::endl;
+
+    std::unique_ptr<QuietLog> quiet(new QuietLog());
+    std::vector<std::shared_ptr<Object>> scenes[3];
+    scenes[0] = createObjects(1000, true);
+    scenes[1].push_back(createHighPolyObject());
+    scenes[2].push_back(createBeamsObject());
+    Camera cameras[] = {Camera(glm::vec3(-4.0f, 6.0f, -4.0f), glm::vec3(0.0f, 1.0f, 0.0f), 45.0f, -30.0f, WIDTH, HEIGHT),
+                        Camera(glm::vec3(3.0f, 0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 180.0f, 0.0f, WIDTH, HEIGHT),
+                        Camera(glm::vec3(-9.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, 0.0f, WIDTH, HEIGHT)};
+    const char *sceneNames[] = {"cubes", MODEL_PATH.empty() ? "sphere" : "model", "beams"};
+    quiet.reset();
+
+    for (int scene = 0; scene < 3; scene++)
+    {
+        if (scenes[scene][0]->mesh == nullptr)
+            continue;
+        CPURenderer renderer(WIDTH, HEIGHT);
+        renderer.packetSize = 1;
+        quiet.reset(new QuietLog());
+        renderer.setUpGeometryData(scenes[scene]);
+        quiet.reset();
+        int tileSizes[] = {32, 128};
+        for (int wavefront = 0; wavefront < 2; wavefront++)
+        {
+            for (int tileSize : tileSizes)
+            {
+                renderer.wavefront = wavefront;
+                renderer.scheduler.tileSize = tileSize;
+                renderer.render(cameras[scene], 4);
+                std::cout << std::setw(10) << sceneNames[scene] << std::setw(12) << (wavefront ? "wavefront" : "megakernel")
+                          << std::setw(12) << tileSize << std::setw(12) << renderer.raysTraced / renderer.renderSeconds / 1e6
+                          << std::setw(16) << double(renderer.nodeVisits) / renderer.raysTraced << std::endl;
+            }
+        }
+    }
+}
+
+// Time until the image is within a noise target of a high sample reference, uniform sampling
+// against adaptive sampling, on the high poly object at a quarter of the resolution. The noise is
+// the RMSE of the displayed, gamma corrected, pixels.
+void benchmarkAdaptiveSampling()
+{
+    const int width = std::max(1u, WIDTH / 4), height = std::max(1u, HEIGHT / 4);
+    const int referenceSamples = 512, maxSamples = 512;
+    const float targetError = 0.003f;
+    std::cout << "\nCPU time to an RMSE of " << std::setprecision(3) << targetError << std::setprecision(2) << " against " << referenceSamples
+              << " samples, " << width << "x" << height << "\n"
+              << std::setw(10) << "mode" << std::setw(12) << "samples" << std::setw(12) << "Mrays" << std::setw(12) << "seconds" << std::setw(12) << "RMSE" << std::endl;
+
+    std::unique_ptr<QuietLog> quiet(new QuietLog());
+    std::vector<std::shared_ptr<Object>> objects;
+    objects.push_back(createHighPolyObject());
+    Camera camera(glm::vec3(3.0f, 0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 180.0f, 0.0f, width, height);
+    quiet.reset();
+    if (objects[0]->mesh == nullptr)
+        return;
+    CPURenderer renderer(width, height);
+    renderer.scheduler.tileSize = 16;
+    quiet.reset(new QuietLog());
+    renderer.setUpGeometryData(objects);
+    quiet.reset();
+    renderer.render(camera, referenceSamples);
+    std::vector<glm::vec3> reference = renderer.getImage();
+
+    for (int adaptive = 0; adaptive < 2; adaptive++)
+    {
+        renderer.adaptiveSampling = adaptive;
+        renderer.adaptiveThreshold = targetError;
+        renderer.resetSampling();
+        double seconds = 0.0, rays = 0.0, error = 1.0;
+        while (error > targetError && !renderer.isConverged() && renderer.getSamples() < unsigned(maxSamples))
+        {
+            renderer.render(camera, 1);
+            seconds += renderer.renderSeconds;
+            rays += renderer.raysTraced;
+            std::vector<glm::vec3> image = renderer.getImage();
+            double squares = 0.0;
+            for (size_t i = 0; i < image.size(); i++)
+            {
+                glm::vec3 difference = image[i] - reference[i];
+                squares += glm::dot(difference, difference) / 3.0f;
+            }
+            error = std::sqrt(squares / image.size());
+        }
+        std::cout << std::setw(10) << (adaptive ? "adaptive" : "uniform") << std::setw(12) << renderer.getSamples() << std::setw(12) << rays / 1e6
+                  << std::setw(12) << seconds << std::setw(12) << std::setprecision(4) << error << std::setprecision(2) << std::endl;
+    }
+}
+
+// Noise of the lit room with and without next event estimation, against a reference with it
+void benchmarkLightSampling()
+{
+    const int width = std::max(1u, WIDTH / 8), height = std::max(1u, HEIGHT / 8);
+    const int referenceSamples = 256;
+    std::cout << "\nCPU light sampling in a closed room against " << referenceSamples << " samples, " << width << "x" << height << "\n"
+              << std::setw(10) << "lights" << std::setw(12) << "samples" << std::setw(12) << "Mrays" << std::setw(12) << "seconds" << std::setw(12) << "RMSE" << std::endl;
+
+    std::unique_ptr<QuietLog> quiet(new QuietLog());
+    std::vector<std::shared_ptr<Object>> objects = createRoomObjects();
+    Camera camera(glm::vec3(1.8f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 180.0f, 0.0f, width, height);
+    CPURenderer renderer(width, height);
+    renderer.setUpGeometryData(objects);
+    quiet.reset();
+    renderer.render(camera, referenceSamples);
+    std::vector<glm::vec3> reference = renderer.getImage();
+
+    int sampleCounts[] = {4, 16, 64};
+    for (int lightSampling = 0; lightSampling < 2; lightSampling++)
+    {
+        renderer.lightSampling = lightSampling;
+        for (int samples : sampleCounts)
+        {
+            renderer.resetSampling();
+            renderer.render(camera, samples);
+            std::vector<glm::vec3> image = renderer.getImage();
+            double squares = 0.0;
+            for (size_t i = 0; i < image.size(); i++)
+            {
+                glm::vec3 difference = image[i] - reference[i];
+                squares += glm::dot(difference, difference) / 3.0f;
+            }
+            std::cout << std::setw(10) << (lightSampling ? "sampled" : "bounces") << std::setw(12) << samples << std::setw(12) << renderer.raysTraced / 1e6
+                      << std::setw(12) << renderer.renderSeconds << std::setw(12) << std::setprecision(4) << std::sqrt(squares / image.size()) << std::setprecision(2) << std::endl;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+        {
+            printUsage();
+            return -1;
+        }
+        std::string value = argv[++i];
+        if (arg == "-n")
+            MAX_OBJECTS = std::atoi(value.c_str());
+        else if (arg == "-w")
+            WIDTH = std::atoi(value.c_str());
+        else if (arg == "-h")
+            HEIGHT = std::atoi(value.c_str());
+        else if (arg == "-m")
+            MODEL_PATH = value;
+        else
+        {
+            printUsage();
+            return -1;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(2);
+    benchmarkGeometrySetUp();
+    benchmarkPacketTraversal();
+    benchmarkWideBVH();
+    benchmarkQuantizedBVH();
+    benchmarkSpatialSplits();
+    benchmarkWavefront();
+    benchmarkAdaptiveSampling();
+    benchmarkLightSampling();
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include <iostream>
+#include <memory>
+#include <string>
+#include <chrono>
+
+#include <object.h>
+#include <mesh_file.h>
+
+void printUsage()
+{
+    std::cout << "usage: raytracer_convert input_model output.rtmesh" << std::endl;
+}
+
+double elapsedMs(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 || !MeshFile::isMeshFile(argv[2]))
+    {
+        printUsage();
+        return -1;
+    }
+    std::string inputPath = argv[1];
+    std::string outputPath = argv[2];
+
+    // imported with the same settings as the renderers
+    auto start = std::chrono::high_resolution_clock::now();
+    Object model(std::string("Model"), IMPORTED, inputPath);
+    if (model.mesh == nullptr)
+        return -1;
+    double importMs = elapsedMs(start);
+
+    if (!MeshFile::write(outputPath, *model.mesh))
+        return -1;
+
+    // load it back the way the renderers do
+    start = std::chrono::high_resolution_clock::now();
+    std::shared_ptr<Mesh> mesh = MeshFile::load(outputPath);
+    if (mesh == nullptr)
+        return -1;
+    double loadMs = elapsedMs(start);
+
+    std::cout << "Converted " << inputPath << " to " << outputPath << ": " << mesh->vertices.size() << " vertices, "
+              << mesh->getTriangleCount() << " triangles. Import " << importMs << " ms, native load " << loadMs << " ms" << std::endl;
+    return 0;
+}
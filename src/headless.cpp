@@ -0,0 +1,201 @@
+#include <glm/glm.hpp>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <chrono>
+
+#include <camera.h>
+#include <object.h>
+#include <cpu_renderer.h>
+
+// settings
+unsigned int WIDTH = 800;
+unsigned int HEIGHT = 450;
+unsigned int SAMPLES = 16;
+
+void printUsage()
+{
+    std::cout << "usage: raytracer_headless [-o output.ppm] [-s samples] [-w width] [-h height] [-m model.obj]\n"
+              << "                          [--bvh sah|parallel|lbvh|hlbvh|sbvh] [--packet 1|4|8|16] [--bvh-width 2|4|8] [--quantized] [--wavefront]\n"
+              << "                          [--cache directory] [--tile-size pixels] [--tile-order morton|spiral]\n"
+              << "                          [--time seconds] [--frame-ms milliseconds] [--adaptive threshold]\n"
+              << "                          [--light x,y,z] [--no-light-sampling]\n"
+              << "                          --quantized traces single rays through the binary BVH with quantized BLAS nodes, it overrides --packet and --bvh-width" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string outputPath = "render.ppm";
+    std::string modelPath = "";
+    BVH_Build_Mode bvhBuildMode = PARALLEL_SAH;
+    int packetSize = 8;
+    int bvhWidth = 0;
+    bool quantizedBVH = false;
+    bool wavefront = false;
+    int tileSize = 32;
+    Tile_Order tileOrder = MORTON_ORDER;
+    double renderTime = 0.0;
+    double frameMs = 16.0;
+    float adaptiveThreshold = 0.0f;
+    std::vector<glm::vec3> lightPositions;
+    bool lightSampling = true;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--quantized")
+        {
+            quantizedBVH = true;
+            continue;
+        }
+        if (arg == "--wavefront")
+        {
+            wavefront = true;
+            continue;
+        }
+        if (arg == "--no-light-sampling")
+        {
+            lightSampling = false;
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            printUsage();
+            return -1;
+        }
+        std::string value = argv[++i];
+        glm::vec3 position;
+        if (arg == "-o")
+            outputPath = value;
+        else if (arg == "-s")
+            SAMPLES = std::atoi(value.c_str());
+        else if (arg == "-w")
+            WIDTH = std::atoi(value.c_str());
+        else if (arg == "-h")
+            HEIGHT = std::atoi(value.c_str());
+        else if (arg == "-m")
+            modelPath = value;
+        else if (arg == "--bvh" && value == "sah")
+            bvhBuildMode = SAH;
+        else if (arg == "--bvh" && value == "parallel")
+            bvhBuildMode = PARALLEL_SAH;
+        else if (arg == "--bvh" && value == "lbvh")
+            bvhBuildMode = LBVH;
+        else if (arg == "--bvh" && value == "hlbvh")
+            bvhBuildMode = HLBVH;
+        else if (arg == "--bvh" && value == "sbvh")
+            bvhBuildMode = SBVH;
+        else if (arg == "--packet" && (value == "1" || value == "4" || value == "8" || value == "16"))
+            packetSize = std::atoi(value.c_str());
+        else if (arg == "--bvh-width" && (value == "2" || value == "4" || value == "8"))
+            bvhWidth = std::atoi(value.c_str());
+        else if (arg == "--cache")
+            BVH_Cache::setDirectory(value);
+        else if (arg == "--tile-size" && std::atoi(value.c_str()) > 0)
+            tileSize = std::atoi(value.c_str());
+        else if (arg == "--tile-order" && value == "morton")
+            tileOrder = MORTON_ORDER;
+        else if (arg == "--tile-order" && value == "spiral")
+            tileOrder = SPIRAL_ORDER;
+        else if (arg == "--time" && std::atof(value.c_str()) > 0.0)
+            renderTime = std::atof(value.c_str());
+        else if (arg == "--frame-ms" && std::atof(value.c_str()) > 0.0)
+            frameMs = std::atof(value.c_str());
+        else if (arg == "--adaptive" && std::atof(value.c_str()) > 0.0)
+            adaptiveThreshold = float(std::atof(value.c_str()));
+        else if (arg == "--light" && std::sscanf(value.c_str(), "%f,%f,%f", &position.x, &position.y, &position.z) == 3)
+            lightPositions.push_back(position);
+        else
+        {
+            printUsage();
+            return -1;
+        }
+    }
+
+    // camera
+    Camera camera(glm::vec3(4.0f, 0.5f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, 0.0f, WIDTH, HEIGHT);
+
+    // objects, same default scene as the interactive app
+    std::vector<std::shared_ptr<Object>> objects;
+    if (modelPath.empty())
+    {
+        std::shared_ptr<Object> cube = std::make_shared<Object>(std::string("Cube"), MESH);
+        objects.push_back(cube);
+        std::shared_ptr<Object> cube2 = std::make_shared<Object>(std::string("Cube2"), MESH);
+        cube2->translate(glm::vec3(0.0f, 0.0f, 2.0f));
+        objects.push_back(cube2);
+        std::shared_ptr<Object> cube3 = std::make_shared<Object>(std::string("Cube3"), MESH);
+        cube3->translate(glm::vec3(-2.0f, 0.0f, 0.0f));
+        objects.push_back(cube3);
+    }
+    else
+    {
+        std::shared_ptr<Object> model = std::make_shared<Object>(std::string("Model"), IMPORTED, modelPath);
+        if (model->mesh == nullptr)
+            return -1;
+        objects.push_back(model);
+    }
+
+    for (auto &&position : lightPositions)
+    {
+        std::shared_ptr<Object> light = std::make_shared<Object>(std::string("Light"), LIGHT);
+        light->translate(position);
+        objects.push_back(light);
+    }
+
+    // render
+    CPURenderer renderer(WIDTH, HEIGHT);
+    renderer.bvhBuildMode = bvhBuildMode;
+    renderer.packetSize = packetSize;
+    if (bvhWidth > 0)
+        renderer.bvhWidth = bvhWidth;
+    renderer.quantizedBVH = quantizedBVH;
+    renderer.wavefront = wavefront;
+    renderer.lightSampling = lightSampling;
+    renderer.scheduler.tileSize = tileSize;
+    renderer.scheduler.order = tileOrder;
+    // progress in steps of 10%, every step is reached by exactly one tile
+    renderer.scheduler.onTileDone = [](const RenderTile &, int tilesDone, int tileCount)
+    {
+        if (tilesDone * 10 / tileCount != (tilesDone - 1) * 10 / tileCount)
+            std::cout << "Rendered " << tilesDone * 100 / tileCount << "% of " << tileCount << " tiles" << std::endl;
+    };
+    if (adaptiveThreshold > 0.0f)
+    {
+        renderer.adaptiveSampling = true;
+        renderer.adaptiveThreshold = adaptiveThreshold;
+        // a progress line per sample would flood the output
+        renderer.scheduler.onTileDone = nullptr;
+    }
+    renderer.setUpGeometryData(objects);
+    if (renderTime > 0.0)
+    {
+        // progressive frames of frameMs until the time is up, like the interactive app
+        renderer.budget.targetSeconds = frameMs * 1e-3;
+        renderer.scheduler.onTileDone = nullptr;
+        auto start = std::chrono::high_resolution_clock::now();
+        int frames = 0;
+        while (!renderer.isConverged() && std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count() < renderTime)
+        {
+            renderer.renderFrame(camera);
+            frames++;
+        }
+        std::cout << "Progressive render: " << frames << " frames, " << renderer.getSamples() << " samples, "
+                  << renderer.getSamplesPerSecond() << " samples/s" << std::endl;
+    }
+    else
+    {
+        renderer.render(camera, SAMPLES);
+        renderer.printStats();
+    }
+    if (renderer.isConverged())
+        std::cout << "Adaptive sampling converged after " << renderer.getSamples() << " samples" << std::endl;
+
+    if (!renderer.writeImage(outputPath))
+        return -1;
+    std::cout << "Saved " << outputPath << std::endl;
+    return 0;
+}
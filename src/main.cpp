@@ -83,6 +83,9 @@ int main()
     glStencilFunc(GL_NOTEQUAL, 1, 0xFF);
     glStencilOp(GL_KEEP, GL_KEEP, GL_REPLACE);
 
+    // imported models and their BLAS are kept between runs
+    BVH_Cache::setDirectory("cache");
+
     // create scene
     std::shared_ptr<Scene> scene = std::make_shared<Scene>(gui->sceneViewWidth, gui->sceneViewHeight, PREVIEW);
 
@@ -0,0 +1,125 @@
+// Low discrepancy sampler of the path tracers. The dimensions of a path are drawn in pairs, each
+// pair from a 2D Sobol sequence that is Owen scrambled, index and values, with a hash of the pixel
+// and the pair (Burley, Practical Hash-based Owen Scrambling, 2020). The first 2^k samples of a
+// pixel stratify every pair of dimensions and neighbouring pixels are decorrelated. The warps to
+// the disk and the hemisphere are branch free, without the rejection loops of the hash RNG.
+//
+// The file is included by the compute shader and, as C++, by sampler.h, so it sticks to the
+// scalar and vector code both languages share.
+
+#ifdef __cplusplus
+#define SAMPLER_FUNCTION inline
+#else
+#define SAMPLER_FUNCTION
+#endif
+
+#define SAMPLER_PI 3.14159265f
+
+// lowbias32 integer hash of Chris Wellons
+SAMPLER_FUNCTION uint samplerHash(uint x) {
+  x ^= x >> 16u;
+  x *= 0x7feb352du;
+  x ^= x >> 15u;
+  x *= 0x846ca68bu;
+  x ^= x >> 16u;
+  return x;
+}
+
+// Laine-Karras permutation, an Owen scramble of bit reversed values: every bit only depends on
+// the seed and the lower bits
+SAMPLER_FUNCTION uint samplerLaineKarras(uint x, uint seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+// Second dimension of the Sobol sequence, bit reversed, the first one is the reversed index. The
+// generator matrix is the Pascal matrix mod 2, so by Lucas' theorem bit j is the xor of the index
+// bits k where j is a subset of k, five shifts instead of a loop over the index bits.
+SAMPLER_FUNCTION uint samplerSobolSecondReversed(uint index) {
+  index ^= (index >> 1u) & 0x55555555u;
+  index ^= (index >> 2u) & 0x33333333u;
+  index ^= (index >> 4u) & 0x0f0f0f0fu;
+  index ^= (index >> 8u) & 0x00ff00ffu;
+  index ^= (index >> 16u) & 0x0000ffffu;
+  return index;
+}
+
+// seed of the samples of a pixel
+SAMPLER_FUNCTION uint samplerPixelSeed(uint x, uint y) {
+  return samplerHash(x ^ samplerHash(y ^ 0x9e3779b9u));
+}
+
+// Point in [0, 1)^2 of the sample for the pair of dimensions. Sample indices start at 0, every
+// pair gets its own shuffle of the indices so the pairs are not correlated.
+SAMPLER_FUNCTION vec2 samplerSample2D(uint pixelSeed, uint sampleIndex, uint pair) {
+  uint seed = samplerHash(pixelSeed ^ samplerHash(pair));
+  // the scrambles work on reversed bits, the Sobol dimensions are scrambled before they are
+  // reversed back
+  uint index = bitfieldReverse(
+      samplerLaineKarras(bitfieldReverse(sampleIndex), seed));
+  uint x = bitfieldReverse(samplerLaineKarras(index, samplerHash(seed + 1u)));
+  uint y = bitfieldReverse(samplerLaineKarras(
+      samplerSobolSecondReversed(index), samplerHash(seed + 2u)));
+  // 24 bits, exact in a float
+  return vec2(float(x >> 8u), float(y >> 8u)) * (1.0f / 16777216.0f);
+}
+
+// Concentric map of the square onto the unit disk (Shirley and Chiu), the selects keep it free of
+// branches and of the division by zero in the center
+SAMPLER_FUNCTION vec2 samplerConcentricDisk(vec2 u) {
+  float a = 2.0f * u.x - 1.0f;
+  float b = 2.0f * u.y - 1.0f;
+  bool major = abs(a) > abs(b);
+  float r = major ? a : b;
+  float ratio = major ? b / a : a / (b == 0.0f ? 1.0f : b);
+  float phi = major ? 0.25f * SAMPLER_PI * ratio : 0.5f * SAMPLER_PI - 0.25f * SAMPLER_PI * ratio;
+  return r * vec2(cos(phi), sin(phi));
+}
+
+// Branch free orthonormal basis around a unit vector (Duff et al. 2017)
+SAMPLER_FUNCTION vec3 samplerTangent(vec3 normal) {
+  float s = normal.z >= 0.0f ? 1.0f : -1.0f;
+  float a = -1.0f / (s + normal.z);
+  return vec3(1.0f + s * normal.x * normal.x * a, s * normal.x * normal.y * a, -s * normal.x);
+}
+
+SAMPLER_FUNCTION vec3 samplerBitangent(vec3 normal) {
+  float s = normal.z >= 0.0f ? 1.0f : -1.0f;
+  float a = -1.0f / (s + normal.z);
+  return vec3(normal.x * normal.y * a, s + normal.y * normal.y * a, -normal.y);
+}
+
+// cosine distributed direction around the unit normal, the disk point lifted to the hemisphere,
+// its pdf is cos / pi
+SAMPLER_FUNCTION vec3 samplerCosineHemisphere(vec3 normal, vec2 u) {
+  vec2 disk = samplerConcentricDisk(u);
+  float z = sqrt(max(0.0f, 1.0f - disk.x * disk.x - disk.y * disk.y));
+  return disk.x * samplerTangent(normal) + disk.y * samplerBitangent(normal) + z * normal;
+}
+
+// Direction uniform in the solid angle of the cone around the unit axis whose half angle has the
+// squared sine sin2ThetaMax, the cone of a sphere seen from outside. The cosines are computed from
+// 1 - cos, which keeps the cones of small or far lights exact.
+SAMPLER_FUNCTION vec3 samplerUniformCone(vec3 axis, float sin2ThetaMax, vec2 u) {
+  float cosThetaMax = sqrt(max(0.0f, 1.0f - sin2ThetaMax));
+  float oneMinusCos = u.x * sin2ThetaMax / (1.0f + cosThetaMax);
+  float sinTheta = sqrt(max(0.0f, oneMinusCos * (2.0f - oneMinusCos)));
+  float phi = 2.0f * SAMPLER_PI * u.y;
+  return sinTheta * cos(phi) * samplerTangent(axis) + sinTheta * sin(phi) * samplerBitangent(axis) +
+         (1.0f - oneMinusCos) * axis;
+}
+
+// solid angle pdf of samplerUniformCone, 1 / (2 pi (1 - cos))
+SAMPLER_FUNCTION float samplerUniformConePdf(float sin2ThetaMax) {
+  float cosThetaMax = sqrt(max(0.0f, 1.0f - sin2ThetaMax));
+  return (1.0f + cosThetaMax) / (2.0f * SAMPLER_PI * sin2ThetaMax);
+}
+
+// multiple importance sampling weight of a sample drawn with pdf against another strategy
+SAMPLER_FUNCTION float samplerPowerHeuristic(float pdf, float otherPdf) {
+  return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+}